@@ -21,6 +21,7 @@
  * 2022.06.24 V1.0.6 <Donald Huang> 1.Enable QE Bit After Flash to avoid write status clear                             
  *---------------------------------------------------------------------------------*/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -33,6 +34,15 @@
 #include "itedlb4flash.h"
 
 #include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #define VERSION "1.0.6"
 
@@ -68,7 +78,7 @@ void hexdump(unsigned char *buffer,int len)
 
 static int read_from_itedev(uint8_t *CMD,unsigned int ReadDataBytes, unsigned char* ReadData)
 {
-        static uint32_t tag = 1;
+        static ITE_TLS uint32_t tag = 1;
         uint8_t cdb_len;
         int i, r, size;
         DLB4_CBW CBW;
@@ -86,10 +96,10 @@ static int read_from_itedev(uint8_t *CMD,unsigned int ReadDataBytes, unsigned ch
         	memcpy(CBW.CB,CMD,CBW.bCBLength);
         	memcpy(szBuffer,&CBW,sizeof(CBW));
 		do {
-        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, (unsigned char*)&szBuffer, sizeof(CBW), &bytesWritten, 1000);
+        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, (unsigned char*)&szBuffer, sizeof(CBW), &bytesWritten, g_tmo.cbw);
                         if(bResult!=LIBUSB_SUCCESS) {
                                 ITE_DBG("bResult=%d\n",bResult);
-                                return -1;
+                                return bResult;
                         }
 
 
@@ -104,11 +114,11 @@ static int read_from_itedev(uint8_t *CMD,unsigned int ReadDataBytes, unsigned ch
         	if(ReadDataBytes>0) {
 	  		bytesRead = 0;
 			do {
-          			bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, ReadData, ReadDataBytes, &bytesRead, 5000);
+          			bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, ReadData, ReadDataBytes, &bytesRead, g_tmo.data);
 	  
                         	if(bResult!=LIBUSB_SUCCESS) {
                                 	ITE_DBG("\n\rbResult=%d",bResult);
-                                	return -1;
+                                	return bResult;
                         	}
           			if (bResult == LIBUSB_ERROR_PIPE) {
                   			libusb_clear_halt(devinfo.handle, devinfo.endpoint_out);
@@ -118,7 +128,7 @@ static int read_from_itedev(uint8_t *CMD,unsigned int ReadDataBytes, unsigned ch
         	}
 
 		do {
-        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, (unsigned char*)&szBuffer, sizeof(CSW), &bytesRead, 1000);
+        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, (unsigned char*)&szBuffer, sizeof(CSW), &bytesRead, g_tmo.csw);
 
         		if (bResult == LIBUSB_ERROR_PIPE) {
                   		libusb_clear_halt(devinfo.handle, devinfo.endpoint_out);
@@ -141,7 +151,7 @@ static int read_from_itedev(uint8_t *CMD,unsigned int ReadDataBytes, unsigned ch
 
 static int write_to_itedev(uint8_t *CMD, unsigned int WriteDataBytes, unsigned char* WriteData)
 {
-        static uint32_t tag = 1;
+        static ITE_TLS uint32_t tag = 1;
         uint8_t cdb_len;
         int i, r, size;
         DLB4_CBW CBW;
@@ -159,10 +169,10 @@ static int write_to_itedev(uint8_t *CMD, unsigned int WriteDataBytes, unsigned c
         	memcpy(CBW.CB,CMD,CBW.bCBLength);
         	memcpy(szBuffer,&CBW,sizeof(CBW));
 		do {
-        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, (unsigned char*)&szBuffer, sizeof(CBW), &bytesWritten, 1000);
+        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, (unsigned char*)&szBuffer, sizeof(CBW), &bytesWritten, g_tmo.cbw);
 			if(bResult!=LIBUSB_SUCCESS) {
 				ITE_DBG("bResult=%d\n",bResult);
-				return -1;
+				return bResult;
 			}	
         		if (bResult == LIBUSB_ERROR_PIPE) {
                   		libusb_clear_halt(devinfo.handle, devinfo.endpoint_out);
@@ -174,10 +184,10 @@ static int write_to_itedev(uint8_t *CMD, unsigned int WriteDataBytes, unsigned c
 
         	if(WriteDataBytes>0) {
 			do {
-          			bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, WriteData, WriteDataBytes, &bytesWritten, 5000);
+          			bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_out, WriteData, WriteDataBytes, &bytesWritten, g_tmo.data);
 				if(bResult!=LIBUSB_SUCCESS) {
 					ITE_DBG("\n\rbResult=%d",bResult);
-					return -1;
+					return bResult;
 				}	
           			if (bResult == LIBUSB_ERROR_PIPE) {
                   			libusb_clear_halt(devinfo.handle, devinfo.endpoint_out);
@@ -188,10 +198,10 @@ static int write_to_itedev(uint8_t *CMD, unsigned int WriteDataBytes, unsigned c
         	}
 
 		do {
-        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, (unsigned char*)&szBuffer, sizeof(CSW), &bytesRead, 1000);
+        		bResult=libusb_bulk_transfer(devinfo.handle, devinfo.endpoint_in, (unsigned char*)&szBuffer, sizeof(CSW), &bytesRead, g_tmo.csw);
 			if(bResult!=LIBUSB_SUCCESS) {
 				ITE_DBG("\n\rbResult=%d",bResult);
-				return -1;
+				return bResult;
 			}	
         		if (bResult == LIBUSB_ERROR_PIPE) {
                   		libusb_clear_halt(devinfo.handle, devinfo.endpoint_out);
@@ -210,9 +220,297 @@ static int write_to_itedev(uint8_t *CMD, unsigned int WriteDataBytes, unsigned c
         return bResult;
 }
 
+double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+}
+
+void stop_request(int sig)
+{
+	g_stop=1;
+}
+
+int cmd_class(DLB4_OP *cmd)
+{
+	if(cmd->op_code==ITE_FW_CTL)
+		return ITE_CMD_CTRL;
+	if(cmd->fun_code==ITE_FUN_CODE_READ)
+		return ITE_CMD_READ;
+	if(cmd->fun_code==ITE_FUN_CODE_WRITE)
+		return ITE_CMD_WRITE;
+	if(cmd->fun_code==ITE_FUN_CODE_ERASE) {
+		if(cmd->p1==ITE_ERASE_MODE_0_CHIP_ERASE)
+			return ITE_CMD_CHIP_ERASE;
+		return ITE_CMD_ERASE;
+	}
+	return ITE_CMD_EC;
+}
+
+// Typical duration of an erase command on the connected part
+unsigned int erase_expect_ms(int cls)
+{
+	if(cls==ITE_CMD_CHIP_ERASE) {
+		if(g_spi_part!=NULL)
+			return g_spi_part->chip_erase_ms;
+		return (g_geom.size/0x100000+1)*ITE_TMO_ERASE_PER_MB;
+	}
+	if(g_spi_part!=NULL)
+		return g_spi_part->block_erase_ms;
+	if(!(g_flag&ITE_USE_SPI) && !g_external && g_chip!=NULL)
+		return g_chip->erase_ms;
+	return ITE_TMO_ERASE_TYP;
+}
+
+// Timeouts for one command: fixed defaults until ITE_TMO_WARMUP samples
+// exist for its class, then mean + 4 deviations of the observed latency
+// plus ITE_TMO_SLACK. EC side commands differ too much from each other
+// (I2C init, run control, status) to share one estimate and keep the
+// defaults. Erase commands are never cut shorter than three times the
+// part's typical erase time.
+void set_cmd_timeout(int cls)
+{
+	CmdStats *st=&g_cmd_stats[cls];
+	CmdStats *ctrl=&g_cmd_stats[ITE_CMD_CTRL];
+	unsigned int t,erase;
+
+	g_tmo.cbw=ITE_TMO_CMD;
+	g_tmo.data=ITE_TMO_DATA;
+	g_tmo.csw=ITE_TMO_CMD;
+
+	if(ctrl->count>=ITE_TMO_WARMUP)
+		g_tmo.cbw=ctrl->mean_ms+4*ctrl->dev_ms+ITE_TMO_SLACK;
+	if(cls!=ITE_CMD_EC && st->count>=ITE_TMO_WARMUP) {
+		t=st->mean_ms+4*st->dev_ms+ITE_TMO_SLACK;
+		g_tmo.data=t;
+		g_tmo.csw=t;
+	}
+
+	if(cls==ITE_CMD_ERASE || cls==ITE_CMD_CHIP_ERASE) {
+		erase=erase_expect_ms(cls)*3;
+		if(g_tmo.data<erase)
+			g_tmo.data=erase;
+		if(g_tmo.csw<erase)
+			g_tmo.csw=erase;
+	}
+}
+
+void update_cmd_stats(int cls,double ms,int status)
+{
+	CmdStats *st=&g_cmd_stats[cls];
+	double dev;
+
+	if(status<0) {
+		st->fails++;
+		if(status==LIBUSB_ERROR_TIMEOUT)
+			st->timeouts++;
+		return;
+	}
+
+	st->count++;
+	st->total_ms+=ms;
+	if(ms>st->max_ms)
+		st->max_ms=ms;
+	dev=(ms>st->mean_ms)?ms-st->mean_ms:st->mean_ms-ms;
+	if(st->count<=ITE_TMO_WARMUP) {
+		//plain average while warming up, kept as the health baseline
+		st->mean_ms+=(ms-st->mean_ms)/st->count;
+		st->dev_ms+=(dev-st->dev_ms)/st->count;
+		st->base_ms=st->mean_ms;
+		return;
+	}
+	st->dev_ms+=(dev-st->dev_ms)/8;
+	st->mean_ms+=(ms-st->mean_ms)/8;
+}
+
+void update_jitter(double gap)
+{
+	g_jit.gaps++;
+	g_jit.gap_sum+=gap;
+	if(gap>g_jit.gap_max)
+		g_jit.gap_max=gap;
+	if(gap>1)
+		g_jit.over[0]++;
+	if(gap>10)
+		g_jit.over[1]++;
+	if(gap>100)
+		g_jit.over[2]++;
+}
+
+// Report per class latency and flag classes drifting away from their baseline
+void show_health()
+{
+	static const char *name[ITE_CMD_CLASSES]={"ctrl","read","write","erase","chip erase","ec"};
+	CmdStats *st;
+	int i;
+
+	printf("\n\rUSB latency      :");
+	for(i=0;i<ITE_CMD_CLASSES;i++) {
+		if(g_cmd_stats[i].count)
+			printf(" %s %.1f ms",name[i],g_cmd_stats[i].mean_ms);
+	}
+	for(i=0;i<ITE_CMD_CLASSES;i++) {
+		st=&g_cmd_stats[i];
+		if(st->fails)
+			printf("\n\rUSB health WARN  : %s %d fails ( %d timeouts )",name[i],st->fails,st->timeouts);
+		if(st->count>ITE_TMO_WARMUP && st->mean_ms>st->base_ms*ITE_HEALTH_DRIFT)
+			printf("\n\rUSB health WARN  : %s latency %.1f ms, baseline %.1f ms",name[i],st->mean_ms,st->base_ms);
+	}
+	if(g_jit.gaps)
+		printf("\n\rUSB jitter       : gap avg %.2f max %.1f ms, %d > 1 ms, %d > 10 ms, %d > 100 ms, latency +%.1f ms max",
+			g_jit.gap_sum/g_jit.gaps,g_jit.gap_max,g_jit.over[0],g_jit.over[1],g_jit.over[2],g_jit.lat_over_max);
+	printf("\n\r");
+}
+
+void ite_msleep(unsigned int ms)
+{
+	if((g_flag&ITE_DRY_RUN)) {
+		g_dry_sleep_ms+=ms;
+		return;
+	}
+	msleep(ms);
+	//a deliberate wait is not a stall
+	g_jit.last_ms=0;
+}
+
+static pthread_t event_tid;
+static volatile int event_stop;
+
+void *event_thread(void *arg)
+{
+	struct timeval tv;
+
+	while(!event_stop) {
+		tv.tv_sec=0;
+		tv.tv_usec=100000;
+		libusb_handle_events_timeout_completed(NULL,&tv,(int *)&event_stop);
+	}
+	return NULL;
+}
+
+// --low-jitter: handle libusb events on a dedicated thread pinned to one
+// CPU at SCHED_FIFO, and run the issuing threads at SCHED_FIFO one level
+// below it so they are not preempted between transfers. Without the
+// privilege both stay at normal priority and only the pinning applies.
+int lowjit_start()
+{
+	struct sched_param sp;
+	cpu_set_t set;
+	int r,fifo;
+
+	if(g_rt_cpu<0)
+		g_rt_cpu=sysconf(_SC_NPROCESSORS_ONLN)-1;
+	event_stop=0;
+	r=pthread_create(&event_tid,NULL,event_thread,NULL);
+	if(r) {
+		printf("\n\rLow jitter       : no event thread ( %s )\n\r",strerror(r));
+		return ITE_ERR;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(g_rt_cpu,&set);
+	r=pthread_setaffinity_np(event_tid,sizeof(set),&set);
+	if(r)
+		printf("\n\rLow jitter       : CPU %d not available ( %s )",g_rt_cpu,strerror(r));
+
+	sp.sched_priority=ITE_RT_PRIO;
+	fifo=(pthread_setschedparam(event_tid,SCHED_FIFO,&sp)==0);
+	if(fifo) {
+		sp.sched_priority=ITE_RT_PRIO-1;
+		pthread_setschedparam(pthread_self(),SCHED_FIFO,&sp);
+	}
+	printf("\n\rLow jitter       : event thread on CPU %d, %s\n\r",g_rt_cpu,
+		fifo?"SCHED_FIFO":"normal priority ( SCHED_FIFO not permitted )");
+	return 0;
+}
+
+void lowjit_stop()
+{
+	if(!(g_flag&ITE_LOW_JITTER))
+		return;
+	event_stop=1;
+	libusb_interrupt_event_handler(NULL);
+	pthread_join(event_tid,NULL);
+}
+
+// keep the image, read back and program stage buffers resident
+void lock_buffers(void *stage,int stage_size)
+{
+	static int warned;
+
+	if(!(g_flag&ITE_LOW_JITTER))
+		return;
+	if(((g_writebuf && mlock(g_writebuf,g_flash_size)) || (g_readbuf && mlock(g_readbuf,g_flash_size)) ||
+	    (stage && mlock(stage,stage_size))) && !warned) {
+		printf("\n\rLow jitter       : mlock failed ( %s ), check ulimit -l\n\r",strerror(errno));
+		warned=1;
+	}
+}
+
+// Stand-in for the DLB4 during --dry-run: answers ID and register reads
+// for the --target part and keeps a RAM copy of the flash, so every stage
+// issues exactly the commands a real run would.
+int dry_run_cmd(DLB4_OP *cmd,int cls)
+{
+	uint32_t id=g_dry_target;
+	int blk,size=g_geom.size?g_geom.size:g_blk_size*16;
+	uint32_t ss=g_geom.sector_size?g_geom.sector_size:0x1000;
+	uint32_t addr,i;
+
+	g_dry_count[cls]++;
+	if(g_dry_flash==NULL || g_dry_flash_size<size) {
+		g_dry_flash=realloc(g_dry_flash,size);
+		memset(g_dry_flash+g_dry_flash_size,0x5A,size-g_dry_flash_size);
+		g_dry_flash_size=size;
+	}
+	if(cmd->direction==ITE_DIR_IN && cmd->buffer!=NULL)
+		memset(cmd->buffer,0,cmd->size);
+
+	if(cmd->op_code==ITE_FW_CTL)
+		return 0;
+
+	if(cmd->fun_code==ITE_FUN_CODE_CHIPID_READ) {
+		cmd->buffer[0]=(id>>8)&0xff;
+		cmd->buffer[1]=id&0xff;
+	} else if(cmd->fun_code==ITE_FUN_CODE_READ_REG && cmd->p1==0x20 && cmd->p2>=0x85 && cmd->p2<=0x87) {
+		cmd->buffer[0]=(id>>((0x87-cmd->p2)*8))&0xff;
+	} else if(cmd->fun_code==ITE_FUN_CODE_FLASHID) {
+		if(g_external)
+			id=0xef4018; //W25Q128 behind the EC
+		else if(!(g_flag&ITE_USE_SPI))
+			id=0xc86514; //internal flash seen by the IT8xxx2 parts
+		cmd->buffer[0]=(id>>16)&0xff;
+		cmd->buffer[1]=(id>>8)&0xff;
+		cmd->buffer[2]=id&0xff;
+	} else if(cmd->fun_code==ITE_FUN_CODE_READ) {
+		blk=cmd->p1+cmd->p5*256;
+		if((blk+1)*65536<=g_dry_flash_size)
+			memcpy(cmd->buffer,g_dry_flash+blk*65536,cmd->size);
+	} else if(cmd->fun_code==ITE_FUN_CODE_WRITE) {
+		blk=cmd->p2+cmd->p5*256;
+		for(i=0;i<cmd->size && blk*65536+i<g_dry_flash_size;i++)
+			g_dry_flash[blk*65536+i]&=cmd->buffer[i];
+	} else if(cmd->fun_code==ITE_FUN_CODE_ERASE) {
+		blk=cmd->p3+cmd->p5*256;
+		addr=blk*65536+cmd->p4*256;
+		if(cmd->p1==ITE_ERASE_MODE_0_CHIP_ERASE)
+			memset(g_dry_flash,0xFF,g_dry_flash_size);
+		else if(cmd->p1==ITE_ERASE_MODE_2_BLOCK_ERASE && (blk+1)*65536<=g_dry_flash_size)
+			memset(g_dry_flash+blk*65536,0xFF,65536);
+		else if(addr/ss*ss+ss<=g_dry_flash_size)
+			memset(g_dry_flash+addr/ss*ss,0xFF,ss);
+	}
+
+	return 0;
+}
+
 int DoCMD(DLB4_OP *cmd)
 {
 	int status=0;
+	int cls;
+	double t0;
 	unsigned char cmdbuf[DLB4_CBW_CBLength];
 
 	cmdbuf[0]=cmd->op_code;
@@ -225,6 +523,14 @@ int DoCMD(DLB4_OP *cmd)
 	cmdbuf[7]=cmd->p6;
 	cmdbuf[8]=cmd->p7;
 
+	cls=cmd_class(cmd);
+	if((g_flag&ITE_DRY_RUN))
+		return dry_run_cmd(cmd,cls);
+	set_cmd_timeout(cls);
+	t0=now_ms();
+	if(g_jit.last_ms>0)
+		update_jitter(t0-g_jit.last_ms);
+
 	if(cmd->direction==ITE_DIR_IN) {
 		status = read_from_itedev(cmdbuf, cmd->size,cmd->buffer);
 	}	
@@ -233,6 +539,11 @@ int DoCMD(DLB4_OP *cmd)
                 status = write_to_itedev(cmdbuf, cmd->size,cmd->buffer);
         }
 
+	update_cmd_stats(cls,now_ms()-t0,status);
+	g_jit.last_ms=now_ms();
+	if(g_cmd_stats[cls].count>ITE_TMO_WARMUP && g_jit.last_ms-t0-g_cmd_stats[cls].mean_ms>g_jit.lat_over_max)
+		g_jit.lat_over_max=g_jit.last_ms-t0-g_cmd_stats[cls].mean_ms;
+
 	return status;
 }	
 
@@ -433,6 +744,116 @@ int ReadReg(uint8_t high,uint8_t low ,uint8_t *data)
         return bResult;
 }
 
+// one flag per transfer: with --low-jitter the callbacks run on the event
+// thread while this thread is still submitting
+static void LIBUSB_CALL reg_xfer_done(struct libusb_transfer *xfer)
+{
+	*(int *)xfer->user_data=1;
+}
+
+// Issue len single-byte register commands from addr with up to
+// ITE_REG_WINDOW of them in flight. Each endpoint keeps its order, so
+// the next CBW queues behind the current one and the data and CSW stages
+// come back in turn without a host round trip per byte.
+int reg_pipeline(uint8_t fun_code,uint16_t addr,uint8_t *buf,int len)
+{
+	struct libusb_transfer *xfer[ITE_REG_WINDOW*3];
+	uint8_t cbw[ITE_REG_WINDOW][32],csw[ITE_REG_WINDOW][32];
+	struct timeval tv;
+	DLB4_CBW CBW;
+	DLB4_CSW CSW;
+	double t0;
+	int done[ITE_REG_WINDOW*3];
+	int i,k,n,x,sub,r=0;
+	int in=(fun_code==ITE_FUN_CODE_READ_REG);
+
+	if((g_flag&ITE_DRY_RUN)) {
+		for(i=0;i<len && r>=0;i++)
+			r=in?ReadReg((addr+i)>>8,(addr+i)&0xff,buf+i):WriteReg((addr+i)>>8,(addr+i)&0xff,buf[i]);
+		return r;
+	}
+
+	set_cmd_timeout(ITE_CMD_EC);
+	for(i=0;i<len && r==0;i+=n) {
+		n=(len-i<ITE_REG_WINDOW)?len-i:ITE_REG_WINDOW;
+		x=0;
+		for(k=0;k<n;k++) {
+			memset(&CBW,0,sizeof(CBW));
+			CBW.dSignature=DLB4_CBW_Signature;
+			CBW.dTag=rand();
+			CBW.dDataLength=1;
+			CBW.bmFlags=in?0x80:0x00;
+			CBW.bCBLength=DLB4_CBW_CBLength;
+			CBW.CB[0]=ITE_OP_CODE;
+			CBW.CB[1]=fun_code;
+			CBW.CB[2]=(addr+i+k)>>8;
+			CBW.CB[3]=(addr+i+k)&0xff;
+			CBW.CB[8]=0xf0;
+			memcpy(cbw[k],&CBW,sizeof(CBW));
+
+			xfer[x]=libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(xfer[x],devinfo.handle,devinfo.endpoint_out,cbw[k],sizeof(CBW),
+				reg_xfer_done,&done[x],g_tmo.cbw);
+			x++;
+			xfer[x]=libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(xfer[x],devinfo.handle,in?devinfo.endpoint_in:devinfo.endpoint_out,
+				buf+i+k,1,reg_xfer_done,&done[x],g_tmo.data);
+			x++;
+			xfer[x]=libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(xfer[x],devinfo.handle,devinfo.endpoint_in,csw[k],sizeof(CSW),
+				reg_xfer_done,&done[x],g_tmo.csw);
+			x++;
+		}
+
+		t0=now_ms();
+		memset(done,0,sizeof(done));
+		for(sub=0;sub<x;sub++) {
+			if(libusb_submit_transfer(xfer[sub])!=LIBUSB_SUCCESS) {
+				r=LIBUSB_ERROR_IO;
+				break;
+			}
+		}
+		for(k=0;k<sub;k++) {
+			while(!done[k]) {
+				tv.tv_sec=0;
+				tv.tv_usec=100000;
+				libusb_handle_events_timeout_completed(NULL,&tv,&done[k]);
+			}
+		}
+		for(k=0;k<sub;k++) {
+			if(r==0 && xfer[k]->status!=LIBUSB_TRANSFER_COMPLETED)
+				r=(xfer[k]->status==LIBUSB_TRANSFER_TIMED_OUT)?LIBUSB_ERROR_TIMEOUT:LIBUSB_ERROR_IO;
+			if(r==0 && k%3==2) {
+				memcpy(&CSW,csw[k/3],sizeof(CSW));
+				if(CSW.dSignature!=DLB4_CSW_Signature) {
+					printf("\n\r**Error Signature** (%08x)\n\r",CSW.dSignature);
+					r=LIBUSB_ERROR_IO;
+				}
+			}
+		}
+		for(k=0;k<x;k++)
+			libusb_free_transfer(xfer[k]);
+		//amortized latencies would skew the per command statistics, only failures are counted
+		if(r<0)
+			update_cmd_stats(ITE_CMD_EC,now_ms()-t0,r);
+	}
+
+	return r;
+}
+
+// Read len EC registers from addr. The firmware is only known to return
+// one byte per register read, so the reads are pipelined, not coalesced.
+int ReadRegRange(uint16_t addr,uint8_t *data,int len)
+{
+	return reg_pipeline(ITE_FUN_CODE_READ_REG,addr,data,len);
+}
+
+// Write len EC registers from addr, pipelined like the reads
+int WriteRegRange(uint16_t addr,uint8_t *data,int len)
+{
+	return reg_pipeline(ITE_FUN_CODE_WRITE_REG,addr,data,len);
+}
+
 int WriteNonSSTFlashStatus(uint8_t byte_count,uint8_t s1,uint8_t s2)
 {
 
@@ -526,42 +947,498 @@ int writeflash(int block_num,uint8_t command_mode,uint8_t program_type,uint8_t *
 
 }
 
+// Built-in SPI NOR parts. Erase times are datasheet typicals, used to choose
+// between chip erase and block erase for the image being flashed.
+static const SpiFlashPart spi_parts[] = {
+	//  JEDEC ID        name          size       sector  block    read           write             type              blk   chip
+	{ {0xc8,0x40,0x14}, "GD25Q80",    0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  3000 },
+	{ {0xc8,0x40,0x15}, "GD25Q16",    0x200000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  6000 },
+	{ {0xc8,0x40,0x16}, "GD25Q32",    0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 10000 },
+	{ {0xc8,0x40,0x17}, "GD25Q64",    0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 20000 },
+	{ {0xc8,0x40,0x18}, "GD25Q128",   0x1000000, 0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 40000 },
+	{ {0xc8,0x60,0x14}, "GD25LQ80",   0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  3000 },
+	{ {0xc8,0x60,0x15}, "GD25LQ16",   0x200000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  6000 },
+	{ {0xc8,0x60,0x16}, "GD25LQ32",   0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 10000 },
+	{ {0xc8,0x65,0x14}, "GD25WQ80",   0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 200,  8000 },
+	{ {0xef,0x40,0x14}, "W25Q80",     0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  2500 },
+	{ {0xef,0x40,0x15}, "W25Q16",     0x200000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150,  5000 },
+	{ {0xef,0x40,0x16}, "W25Q32",     0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 10000 },
+	{ {0xef,0x40,0x17}, "W25Q64",     0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 20000 },
+	{ {0xef,0x40,0x18}, "W25Q128",    0x1000000, 0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 40000 },
+	{ {0xef,0x60,0x16}, "W25Q32FW",   0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 10000 },
+	{ {0xef,0x60,0x17}, "W25Q64FW",   0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 20000 },
+	{ {0xef,0x70,0x17}, "W25Q64JV-M", 0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 20000 },
+	{ {0xef,0x70,0x18}, "W25Q128JV-M",0x1000000, 0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 40000 },
+	{ {0xc2,0x20,0x14}, "MX25L8006E", 0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 700,  9000 },
+	{ {0xc2,0x20,0x15}, "MX25L1606E", 0x200000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 700, 14000 },
+	{ {0xc2,0x20,0x16}, "MX25L3233F", 0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 400, 25000 },
+	{ {0xc2,0x20,0x17}, "MX25L6433F", 0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 400, 50000 },
+	{ {0xc2,0x20,0x18}, "MX25L12835F",0x1000000, 0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 400, 80000 },
+	{ {0xc2,0x25,0x36}, "MX25U3235F", 0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 400, 25000 },
+	{ {0xc2,0x25,0x37}, "MX25U6435F", 0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 400, 50000 },
+	{ {0x1c,0x30,0x14}, "EN25Q80",    0x100000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 300,  8000 },
+	{ {0x1c,0x30,0x16}, "EN25Q32",    0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 300, 30000 },
+	{ {0x9d,0x60,0x16}, "IS25LP032",  0x400000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 10000 },
+	{ {0x9d,0x60,0x17}, "IS25LP064",  0x800000,  0x1000, 0x10000, ITE_READ_MODE, ITE_PROGRAM_MODE, ITE_PROGRAM_TYPE, 150, 20000 },
+};
+
+// Parts file format, one part per line ('#' starts a comment):
+//   <jedec id> <name> <size> <sector> <block> <read> <write> <type> <blk_ms> <chip_ms>
+//   c86514     GD25WQ80E 0x100000 0x1000 0x10000 3 3 0 200 8000
+int load_spi_parts(char *filename)
+{
+	FILE *fp;
+	char line[256];
+	unsigned int id,size,sector,block,rmode,wmode,wtype,blk_ms,chip_ms;
+	char name[24];
+	int n=0;
+	SpiFlashPart *part;
+
+	if((fp=fopen(filename,"r"))==NULL) {
+		printf("\n\ropen parts file error : %s",filename);
+		return ITE_ERR;
+	}
+
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		n++;
+		if(line[0]=='#' || line[0]=='\n' || line[0]=='\r')
+			continue;
+		if(sscanf(line,"%x %23s %i %i %i %i %i %i %i %i",&id,name,&size,&sector,&block,
+				&rmode,&wmode,&wtype,&blk_ms,&chip_ms)!=10) {
+			printf("\n\r%s:%d: bad part entry, ignored",filename,n);
+			continue;
+		}
+		if(g_spi_parts_ovr_no>=ITE_SPI_PARTS_MAX) {
+			printf("\n\r%s: too many parts, only %d used",filename,ITE_SPI_PARTS_MAX);
+			break;
+		}
+		part=&g_spi_parts_ovr[g_spi_parts_ovr_no++];
+		part->id[0]=(id>>16)&0xff;
+		part->id[1]=(id>>8)&0xff;
+		part->id[2]=id&0xff;
+		strcpy(part->name,name);
+		part->size=size;
+		part->sector_size=sector;
+		part->block_size=block;
+		part->read_mode=rmode;
+		part->write_mode=wmode;
+		part->write_type=wtype;
+		part->block_erase_ms=blk_ms;
+		part->chip_erase_ms=chip_ms;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+SpiFlashPart *find_spi_part(uint8_t *flashid)
+{
+	int i;
+
+	// parts file entries take precedence over the built-in table
+	for(i=0;i<g_spi_parts_ovr_no;i++) {
+		if(memcmp(g_spi_parts_ovr[i].id,flashid,3)==0)
+			return &g_spi_parts_ovr[i];
+	}
+	for(i=0;i<sizeof(spi_parts)/sizeof(spi_parts[0]);i++) {
+		if(memcmp(spi_parts[i].id,flashid,3)==0)
+			return (SpiFlashPart *)&spi_parts[i];
+	}
+	return NULL;
+}
+
+// Pick read/program modes and the cheaper erase strategy for the detected part.
+// Unknown parts keep the defaults set in check_parameter().
+int select_spi_part()
+{
+	uint32_t blk_ms;
+
+	g_spi_part=find_spi_part(g_flash_id);
+	if(g_spi_part==NULL)
+		return 0;
+
+	Flash.read_mode = g_spi_part->read_mode;
+	Flash.write_mode = g_spi_part->write_mode;
+	Flash.write_type = g_spi_part->write_type;
+
+	// block erase only covers the image, chip erase always covers the whole part
+	blk_ms=g_spi_part->block_erase_ms*g_blk_no;
+	if(g_spi_part->block_size==g_blk_size && blk_ms<g_spi_part->chip_erase_ms)
+		Flash.erase_mode = ITE_ERASE_MODE_2_BLOCK_ERASE;
+	else
+		Flash.erase_mode = ITE_ERASE_MODE_0_CHIP_ERASE;
+
+	return 0;
+}
+
+// EC chips and their internal flash. The DLB4 moves flash data in 64 KB
+// blocks, so block_size stays 64 KB for every entry.
+static const EcChipInfo ec_chips[] = {
+	//  chip ID  name        flash     sector  block    erase                          erase ms
+	{ 0x81202, "IT81202", 0x100000, 0x1000, 0x10000, ITE_ERASE_MODE_1_SECTOR_ERASE, 200 },
+	{ 0x81302, "IT81302", 0x100000, 0x1000, 0x10000, ITE_ERASE_MODE_1_SECTOR_ERASE, 200 },
+	{ 0x82202, "IT82202", 0x100000, 0x1000, 0x10000, ITE_ERASE_MODE_1_SECTOR_ERASE, 200 },
+	{ 0x82302, "IT82302", 0x100000, 0x1000, 0x10000, ITE_ERASE_MODE_1_SECTOR_ERASE, 200 },
+};
+
+EcChipInfo *find_ec_chip(uint8_t *chipid)
+{
+	int i;
+	uint32_t id=(chipid[3]<<16)|(chipid[4]<<8)|chipid[5];
+
+	for(i=0;i<sizeof(ec_chips)/sizeof(ec_chips[0]);i++) {
+		if(ec_chips[i].chip_id==id)
+			return (EcChipInfo *)&ec_chips[i];
+	}
+	return NULL;
+}
+
+// Resolve the geometry of the connected flash and mark the sectors the image
+// covers. Oversized images are rejected here, before anything is erased.
+int plan_flash()
+{
+	int i,j,n,end;
+
+	g_geom.size=g_blk_size*16;
+	g_geom.sector_size=0x1000;
+	g_geom.block_size=g_blk_size;
+
+	if((g_flag&ITE_USE_SPI) || g_external) {
+		if(g_spi_part!=NULL) {
+			g_geom.size=g_spi_part->size;
+			g_geom.sector_size=g_spi_part->sector_size;
+		} else if(g_flash_id[2]>=0x10 && g_flash_id[2]<=0x19) {
+			//JEDEC capacity byte is log2 of the size
+			g_geom.size=1<<g_flash_id[2];
+		}
+	} else {
+		g_chip=find_ec_chip(g_chip_id);
+		if(g_chip!=NULL) {
+			g_geom.size=g_chip->flash_size;
+			g_geom.sector_size=g_chip->sector_size;
+			Flash.erase_mode=g_chip->erase_mode;
+		}
+	}
+
+	if(g_file_size>g_geom.size) {
+		printf("\n\rImage size %d exceeds flash size %d, nothing erased",g_file_size,g_geom.size);
+		return ITE_ERR;
+	}
+	if(g_index.blank!=NULL && g_index.buf==g_writebuf && g_index.flash_size && g_index.flash_size!=g_geom.size) {
+		printf("\n\rImage was indexed for a %d KB flash, this one has %d KB, nothing erased",
+			g_index.flash_size/1024,g_geom.size/1024);
+		return ITE_ERR;
+	}
+	for(i=0;i<g_region_no;i++) {
+		if(g_region[i].offset%g_geom.sector_size) {
+			printf("\n\r%s: offset 0x%x is not aligned to the %d byte sector",
+				g_region[i].filename,g_region[i].offset,g_geom.sector_size);
+			return ITE_ERR;
+		}
+	}
+
+	free(g_sect_map);
+	g_sect_no=g_geom.size/g_geom.sector_size;
+	g_sect_map=calloc(g_sect_no,1);
+	if(g_sect_map==NULL) {
+		printf("\n\ralloc g_sect_map fail");
+		return ITE_ERR;
+	}
+
+	//one combined plan covering every image, gaps between images untouched
+	for(i=0;i<g_region_no;i++) {
+		n=(g_region[i].offset+g_region[i].size+g_geom.sector_size-1)/g_geom.sector_size;
+		for(j=g_region[i].offset/g_geom.sector_size;j<n;j++)
+			g_sect_map[j]|=ITE_SECT_ERASE;
+	}
+
+	//--offset/--length: only the window is erased, programmed and verified
+	if(g_win_offset || g_win_length) {
+		//the image's last sector is flashed padded with 0xFF
+		end=(g_file_size+g_geom.sector_size-1)/g_geom.sector_size*g_geom.sector_size;
+		if(g_win_offset>=g_file_size) {
+			printf("\n\rWindow offset 0x%x is past the end of the image",g_win_offset);
+			return ITE_ERR;
+		}
+		if(g_win_length==0)
+			g_win_length=end-g_win_offset;
+		if(g_win_offset+g_win_length>end) {
+			printf("\n\rWindow 0x%x+0x%x runs past the end of the image at 0x%x",
+				g_win_offset,g_win_length,end);
+			return ITE_ERR;
+		}
+		if(g_win_offset%g_geom.sector_size || g_win_length%g_geom.sector_size) {
+			printf("\n\rWindow 0x%x+0x%x is not aligned to the %d byte sector",
+				g_win_offset,g_win_length,g_geom.sector_size);
+			return ITE_ERR;
+		}
+		if(g_win_offset+g_win_length>g_geom.size) {
+			printf("\n\rWindow 0x%x+0x%x exceeds flash size %d",g_win_offset,g_win_length,g_geom.size);
+			return ITE_ERR;
+		}
+		for(j=0;j<g_sect_no;j++) {
+			if(j*g_geom.sector_size<g_win_offset || j*g_geom.sector_size>=g_win_offset+g_win_length)
+				g_sect_map[j]&=~ITE_SECT_ERASE;
+		}
+	}
+
+	//chip erase ignores the plan and would wipe the gaps between images
+	//and the flash past the window or the last image
+	if((g_win_offset || g_win_length || g_region_no>1 || (g_region_no && g_region[0].offset)) &&
+	   Flash.erase_mode==ITE_ERASE_MODE_0_CHIP_ERASE)
+		Flash.erase_mode=ITE_ERASE_MODE_2_BLOCK_ERASE;
+
+	return 0;
+}
+
+int sect_per_blk()
+{
+	return g_geom.block_size/g_geom.sector_size;
+}
+
+// count of sectors in block blk carrying any of the given plan flags
+int blk_planned(int blk,uint8_t flags)
+{
+	int j,n=0;
+	int spb=sect_per_blk();
+
+	for(j=0;j<spb;j++) {
+		if(g_sect_map[blk*spb+j]&flags)
+			n++;
+	}
+	return n;
+}
+
+int erase_sector(int blk,int sect)
+{
+	//sector number carries address bits 15:8 of the last page in the sector
+	uint8_t addr=((sect*g_geom.sector_size)>>8)+(g_geom.sector_size>>8)-1;
+
+	return eraseflash(blk,addr,ITE_ERASE_MODE_1_SECTOR_ERASE,Flash.erase_type);
+}
+
+// the index describes the image in g_writebuf at a sector size the plan
+// can be built from
+int index_usable()
+{
+	return g_index.blank!=NULL && g_index.buf==g_writebuf && g_geom.sector_size%g_index.sector_size==0;
+}
+
+// flash range [offset,offset+len) is blank in the indexed image; past the
+// end of the image the buffer is padding
+int index_blank(int offset,int len)
+{
+	int i;
+
+	for(i=offset/g_index.sector_size;i<(offset+len)/g_index.sector_size && i<g_index.sect_no;i++) {
+		if(!g_index.blank[i])
+			return 0;
+	}
+	return 1;
+}
+
+// Mark planned sectors whose image data is all 0xFF; once erased they
+// need no programming.
+void build_blank_map()
+{
+	int s,l;
+	int ss=g_geom.sector_size;
+	int idx=index_usable();
+
+	for(s=0;s<g_sect_no;s++) {
+		g_sect_map[s]&=~ITE_SECT_BLANK;
+		if(!(g_sect_map[s]&ITE_SECT_ERASE) || (s+1)*ss>g_flash_size)
+			continue;
+		if(idx) {
+			if(index_blank(s*ss,ss))
+				g_sect_map[s]|=ITE_SECT_BLANK;
+			continue;
+		}
+		for(l=s*ss;l<(s+1)*ss && g_writebuf[l]==0xFF;l++)
+			;
+		if(l==(s+1)*ss)
+			g_sect_map[s]|=ITE_SECT_BLANK;
+	}
+	g_blank_ready=1;
+}
+
+static void LIBUSB_CALL async_done(struct libusb_transfer *xfer)
+{
+	*(int *)xfer->user_data=1;
+}
+
+// Chip erase without blocking the host: the CBW is sent and the data and
+// CSW stages are left in flight while the program stage is prepared. As
+// with eraseflash(), the erase is done when the DLB4 returns the CSW;
+// interval only paces the progress line against the part's typical (or
+// observed) erase time.
+int erase_chip_async()
+{
+	struct libusb_transfer *xfer[2];
+	struct timeval tv;
+	DLB4_CBW CBW;
+	DLB4_CSW CSW;
+	uint8_t szBuffer[32],csw[32],data[1];
+	double t0,expect,elapsed;
+	unsigned int interval;
+	int r,done[2]={0,0},sent;
+
+	if((g_flag&ITE_DRY_RUN)) {
+		r=eraseflash(g_blk_no,4,ITE_ERASE_MODE_0_CHIP_ERASE,Flash.erase_type);
+		build_blank_map();
+		return r;
+	}
+
+	expect=erase_expect_ms(ITE_CMD_CHIP_ERASE);
+	if(g_cmd_stats[ITE_CMD_CHIP_ERASE].count)
+		expect=g_cmd_stats[ITE_CMD_CHIP_ERASE].mean_ms;
+	interval=expect/50;
+	if(interval<5)
+		interval=5;
+	if(interval>250)
+		interval=250;
+	set_cmd_timeout(ITE_CMD_CHIP_ERASE);
+
+	memset(&CBW,0,sizeof(CBW));
+	CBW.dSignature=DLB4_CBW_Signature;
+	CBW.dTag=rand();
+	CBW.dDataLength=1;
+	CBW.bmFlags=0x80;
+	CBW.bCBLength=DLB4_CBW_CBLength;
+	CBW.CB[0]=ITE_OP_CODE;
+	CBW.CB[1]=ITE_FUN_CODE_ERASE;
+	CBW.CB[2]=ITE_ERASE_MODE_0_CHIP_ERASE;
+	CBW.CB[3]=Flash.erase_type;
+	CBW.CB[4]=g_blk_no%256;
+	// copy ini file set sector num as 4 
+	CBW.CB[5]=4;
+	CBW.CB[6]=g_blk_no/256;
+	memcpy(szBuffer,&CBW,sizeof(CBW));
+
+	t0=now_ms();
+	r=libusb_bulk_transfer(devinfo.handle,devinfo.endpoint_out,szBuffer,sizeof(CBW),&sent,g_tmo.cbw);
+	if(r!=LIBUSB_SUCCESS)
+		return r;
+
+	xfer[0]=libusb_alloc_transfer(0);
+	xfer[1]=libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(xfer[0],devinfo.handle,devinfo.endpoint_in,data,1,async_done,&done[0],g_tmo.data);
+	libusb_fill_bulk_transfer(xfer[1],devinfo.handle,devinfo.endpoint_in,csw,sizeof(CSW),async_done,&done[1],g_tmo.csw);
+	r=libusb_submit_transfer(xfer[0]);
+	if(r==LIBUSB_SUCCESS)
+		r=libusb_submit_transfer(xfer[1]);
+	else
+		done[0]=done[1]=1;
+	if(r!=LIBUSB_SUCCESS && !done[0]) {
+		libusb_cancel_transfer(xfer[0]);
+		done[1]=1;
+	}
+
+	//host side preparation of the program stage while the part erases
+	build_blank_map();
+
+	while(!done[0] || !done[1]) {
+		tv.tv_sec=interval/1000;
+		tv.tv_usec=(interval%1000)*1000;
+		libusb_handle_events_timeout_completed(NULL,&tv,&done[1]);
+		elapsed=now_ms()-t0;
+		printf("\rEraseing...      : %d%%",(elapsed<expect)?(int)(elapsed*100/expect):99);
+		fflush(stdout);
+	}
+
+	if(r==LIBUSB_SUCCESS) {
+		if(xfer[0]->status!=LIBUSB_TRANSFER_COMPLETED || xfer[1]->status!=LIBUSB_TRANSFER_COMPLETED) {
+			r=(xfer[0]->status==LIBUSB_TRANSFER_TIMED_OUT || xfer[1]->status==LIBUSB_TRANSFER_TIMED_OUT)?
+				LIBUSB_ERROR_TIMEOUT:LIBUSB_ERROR_IO;
+		} else {
+			memcpy(&CSW,csw,sizeof(CSW));
+			if(CSW.dSignature!=DLB4_CSW_Signature) {
+				printf("\n\r**Error Signature** (%08x)\n\r",CSW.dSignature);
+				r=LIBUSB_ERROR_IO;
+			}
+		}
+	}
+	libusb_free_transfer(xfer[0]);
+	libusb_free_transfer(xfer[1]);
+	update_cmd_stats(ITE_CMD_CHIP_ERASE,now_ms()-t0,r);
+	if(r!=LIBUSB_SUCCESS)
+		return r;
+
+	printf("\rEraseing...      : 100%%\n\r");
+        fflush(stdout);
+	return 0;
+}
+
 int eraseall()
 {
 
 	int i,j,r;
-	if((g_flag&ITE_USE_SPI)) {
+	int spb=sect_per_blk();
+
+	if(((g_flag&ITE_USE_SPI) || g_external) && Flash.erase_mode==ITE_ERASE_MODE_0_CHIP_ERASE) {
 		//chip erase
-		// copy ini file set sector num as 4 
-		
-		eraseflash(g_blk_no,4,Flash.erase_mode,Flash.erase_type);
-		printf("\rEraseing...      : 100%%\n\r");
-                fflush(stdout);
-		
-	} else {
-		//sector erase
-		for(i=0;i<g_blk_no;i++) {
-			for(j=0;j<0x10;j++) {
-				r=eraseflash(i,((j<<4)+0xF),Flash.erase_mode,Flash.erase_type);
-				if(r<0) return -1;
+		r=erase_chip_async();
+		if(r<0) return -1;
+		return 0;
+	}
 
+	for(i=0;i<g_blk_no;i++) {
+		if(blk_planned(i,ITE_SECT_ERASE)==spb && Flash.erase_mode==ITE_ERASE_MODE_2_BLOCK_ERASE) {
+			//block erase
+			r=eraseflash(i,0,Flash.erase_mode,Flash.erase_type);
+			if(r<0) return -1;
+		} else {
+			//sector erase
+			for(j=0;j<spb;j++) {
+				if(!(g_sect_map[i*spb+j]&ITE_SECT_ERASE))
+					continue;
+				r=erase_sector(i,j);
+				if(r<0) return -1;
 			}
-			printf("\rEraseing...      : %d%%",(i+1)*100/(g_blk_no));
-                	fflush(stdout);
 		}
-		printf("\n\r");
-	}	
+		printf("\rEraseing...      : %d%%",(i+1)*100/(g_blk_no));
+		fflush(stdout);
+	}
+	printf("\n\r");
 	return 0;
 
 }	
 
+// Program block blk with only the sectors carrying flags; the rest of the
+// block is sent as 0xFF, which leaves those sectors unchanged.
+int program_sectors(int blk,uint8_t flags)
+{
+	static ITE_TLS unsigned char stage[65536];
+	static ITE_TLS int locked;
+	int j;
+	int spb=sect_per_blk();
+	int ss=g_geom.sector_size;
+
+	if(!locked) {
+		lock_buffers(stage,sizeof(stage));
+		locked=1;
+	}
+	if(blk_planned(blk,flags)==spb)
+		return writeflash(blk,Flash.write_mode,Flash.write_type,(unsigned char *)(g_writebuf+blk*65536),65536);
+
+	memset(stage,0xFF,sizeof(stage));
+	for(j=0;j<spb;j++) {
+		if(g_sect_map[blk*spb+j]&flags)
+			memcpy(stage+j*ss,g_writebuf+blk*65536+j*ss,ss);
+	}
+	return writeflash(blk,Flash.write_mode,Flash.write_type,stage,65536);
+}
+
 int programall()
 {
         int i,r;
 
 	for(i=0;i<g_blk_no;i++) {
+		//nothing to send when every planned sector is blank in the image
+		if(blk_planned(i,ITE_SECT_ERASE)==blk_planned(i,ITE_SECT_BLANK))
+			continue;
 
-		r=writeflash(i,Flash.write_mode,Flash.write_type,(unsigned char *)(g_writebuf+(i*65536)),65536);
+		r=program_sectors(i,ITE_SECT_ERASE);
                 printf("\rProgramng...     : %d%%",(i+1)*100/(g_blk_no));
                 fflush(stdout);
 		if(r<0) return -1;
@@ -574,12 +1451,17 @@ int programall()
 
 int checkall()
 {
-	int i,j,r;
+	int i,r;
+	int l,end;
+
         for(i=0;i<g_blk_no;i++) {
-        	readflash(i,Flash.read_mode,(unsigned char *)(g_readbuf+i*65536));
+		if(blk_planned(i,ITE_SECT_ERASE)==0)
+			continue;
+        	r=readflash(i,Flash.read_mode,(unsigned char *)(g_readbuf+i*65536));
 		if(r<0) return -1;
-        	for(j=0;j<65536;j++) {
-			int l=i*65536+j;
+        	for(l=i*65536,end=l+65536;l<end;l++) {
+			if(!(g_sect_map[l/g_geom.sector_size]&ITE_SECT_ERASE))
+				continue;
                 	if(g_readbuf[l]!=0xFF) {
                         	printf("\n\rCheck ERR on offset [%x]=%x",l,g_readbuf[l]);
                         	return 1;
@@ -595,63 +1477,171 @@ int checkall()
 }
 
 
-int verifyall()
+// Compare the sectors carrying flags against the image. Every mismatching
+// sector is marked ITE_SECT_BAD; returns the number of bad sectors.
+int verify_sectors(uint8_t flags,char *stage)
 {
-	int i,j,r;
+	int i,r;
+	int l,end,s;
+	int bad=0,blk_no=0,done=0;
+
+	for(s=0;s<g_sect_no;s++) {
+		if(g_sect_map[s]&flags)
+			g_sect_map[s]&=~ITE_SECT_BAD;
+	}
+        for(i=0;i<g_blk_no;i++) {
+		if(blk_planned(i,flags))
+			blk_no++;
+	}
 
         for(i=0;i<g_blk_no;i++) {
-                readflash(i,Flash.read_mode,(unsigned char *)(g_readbuf+i*65536));
+		if(blk_planned(i,flags)==0)
+			continue;
+                r=readflash(i,Flash.read_mode,(unsigned char *)(g_readbuf+i*65536));
 		if(r<0) return -1;
-                for(j=0;j<65536;j++) {
-			int l=i*65536+j;
+                for(l=i*65536,end=l+65536;l<end;l++) {
+			s=l/g_geom.sector_size;
+			if(!(g_sect_map[s]&flags) || (g_sect_map[s]&ITE_SECT_BAD))
+				continue;
                         if(g_readbuf[l]!=g_writebuf[l]) {
-                        	printf("\n\rCheck ERR on offset r[%x]=%x w[%x]=%x",l,g_readbuf[l],l,g_writebuf[l]);
-                                return 1;
-         
+				if(bad==0)
+                        		printf("\n\rCheck ERR on offset r[%x]=%x w[%x]=%x\n\r",l,g_readbuf[l],l,g_writebuf[l]);
+				g_sect_map[s]|=ITE_SECT_BAD;
+				bad++;
                 	}
         	}
-                printf("\rVerifying...     : %d%%",(i+1)*100/(g_blk_no));
+                printf("\r%s: %d%%",stage,(++done)*100/blk_no);
                 fflush(stdout);
 		
 	}
 
 	printf("\n\r");
 
-	return 0;
-}	
+	return bad;
+}
 
-int init_dlb4_spi()
+// print runs of consecutive sectors carrying flags as address ranges
+int show_sect_ranges(uint8_t flags,char *title)
 {
-	int r;
-	int i=0;
-
-	ITE_OP_CODE = ITE_OP_CODE_DBGR_X;
+	int s,start=-1,n=0;
+
+	for(s=0;s<=g_sect_no;s++) {
+		if(s<g_sect_no && (g_sect_map[s]&flags)) {
+			if(start<0)
+				start=s;
+			n++;
+			continue;
+		}
+		if(start>=0) {
+			printf("%s: %06x - %06x ( %d sectors )\n\r",title,start*g_geom.sector_size,
+				s*g_geom.sector_size-1,s-start);
+			start=-1;
+		}
+	}
+	return n;
+}
 
-	CALL_CHECK(StartD2ec(0x0b));
-	CALL_CHECK(GetDlb4FwVer(g_fw_ver));
-	enter_spi();
-	CALL_CHECK(GetFlashID(g_flash_id,4));
+int verifyall()
+{
+	int bad;
 
-	return 0;
+	bad=verify_sectors(ITE_SECT_ERASE,"Verifying...     ");
+	if(bad>0)
+		show_sect_ranges(ITE_SECT_BAD,"Verify ERR       ");
+	return bad;
 }	
 
-int init_dlb4()
+// Re-erase and re-program only the sectors verify marked bad, then verify
+// them again. Gives up after RETRY_MAX passes.
+int repairall()
 {
-	bool bResult;
-        uint8_t value;
-	int r=0,i=0;
-
-	ITE_OP_CODE = ITE_OP_CODE_DBGR_O;
+	int i,j,r,s;
+	int bad=1,pass;
+	int spb=sect_per_blk();
 
-        Flash.read_mode = 3;
-        Flash.erase_type = ITE_ERASE_TYPE_3_UNPROTECT_E;
-        Flash.erase_mode = ITE_ERASE_MODE_1_SECTOR_ERASE ;
-        Flash.write_type = 0; //ITE_PROGRAM_TYPE
-        Flash.write_mode = 3; //ITE_PROGRAM_MODE
+	for(pass=0;pass<RETRY_MAX && bad>0;pass++) {
+		for(i=0;i<g_blk_no;i++) {
+			if(blk_planned(i,ITE_SECT_BAD)==0)
+				continue;
+			for(j=0;j<spb;j++) {
+				s=i*spb+j;
+				if(!(g_sect_map[s]&ITE_SECT_BAD))
+					continue;
+				g_sect_map[s]|=ITE_SECT_REPAIRED;
+				r=erase_sector(i,j);
+				if(r<0) return -1;
+			}
+			r=program_sectors(i,ITE_SECT_BAD);
+			if(r<0) return -1;
+		}
+		bad=verify_sectors(ITE_SECT_BAD,"Repairing...     ");
+		if(bad<0) return -1;
+	}
+
+	show_sect_ranges(ITE_SECT_REPAIRED,"Repaired         ");
+	if(bad>0)
+		show_sect_ranges(ITE_SECT_BAD,"Repair FAIL      ");
+	return bad;
+}	
+
+// Sleep min_ms, then poll ready() every ITE_WAIT_POLL ms for up to max_ms.
+// Returns 0 once ready() reports 1, -1 on timeout.
+int wait_ready(int (*ready)(),unsigned int min_ms,unsigned int max_ms)
+{
+	double t0;
+
+	ite_msleep(min_ms);
+	t0=now_ms();
+	while(ready()!=1) {
+		if(now_ms()-t0>=max_ms)
+			return -1;
+		ite_msleep(ITE_WAIT_POLL);
+	}
+	return 0;
+}
+
+// the part answers with a real JEDEC ID once the EC has released the bus
+int flash_id_ready()
+{
+	if(GetFlashID(g_flash_id,4)<0)
+		return -1;
+	if((g_flash_id[0]==0x00 && g_flash_id[1]==0x00 && g_flash_id[2]==0x00) ||
+	   (g_flash_id[0]==0xff && g_flash_id[1]==0xff && g_flash_id[2]==0xff))
+		return 0;
+	return 1;
+}
+
+int init_dlb4_spi()
+{
+	int r;
+	int i=0;
+
+	ITE_OP_CODE = ITE_OP_CODE_DBGR_X;
+
+	CALL_CHECK(StartD2ec(0x0b));
+	CALL_CHECK(GetDlb4FwVer(g_fw_ver));
+	enter_spi(g_wait.spi);
+	if(wait_ready(flash_id_ready,0,ITE_WAIT_READY_MAX)) {
+		//no answer with the short steps, retry with the former timing
+		enter_spi(ITE_WAIT_SPI_MAX);
+		wait_ready(flash_id_ready,0,ITE_WAIT_READY_MAX);
+	}
+	CALL_CHECK(GetFlashID(g_flash_id,4));
+
+	return 0;
+}	
+
+// Debugger connect path: enter debug mode and read the chip and flash IDs
+int connect_dbgr()
+{
+        uint8_t value;
+	int r=0;
+
+	ITE_OP_CODE = ITE_OP_CODE_DBGR_O;
 
 	CALL_CHECK(GetDlb4FwVer(g_fw_ver));
         CALL_CHECK(StartD2ec(7)); //Send Special
-        msleep(50);
+        ite_msleep(g_special_ms?g_special_ms:g_wait.special);
         CALL_CHECK(StartD2ec(0)); //Stop Special
         CALL_CHECK(StartD2ec(3)); //Enter Debug Mode
 
@@ -667,211 +1657,2127 @@ int init_dlb4()
 	//CALL_CHECK(StartD2ec(0x02)); //I2C Init & Enter Debug Mode //400K
 	CALL_CHECK(StartD2ec(12)); //I2C Init & Enter Debug Mode //1M
         CALL_CHECK(StartD2ec(0x0a)); //Set Internal Flash
-        //CALL_CHECK(StartD2ec(11)); //Set External Flash
+        //StartD2ec(11) Set External Flash, see flash_external()
         CALL_CHECK(GetChipID(g_chip_id));
 	ReadReg(0x20,0x85,&g_chip_id[3]);
 	ReadReg(0x20,0x86,&g_chip_id[4]);
 	ReadReg(0x20,0x87,&g_chip_id[5]);
         CALL_CHECK(GetFlashID(g_flash_id,0x04));
+
+	return r;
+}	
+
+int init_dlb4()
+{
+	bool bResult;
+	uint8_t zero[0x20];
+	int r=0;
+
+        Flash.read_mode = 3;
+        Flash.erase_type = ITE_ERASE_TYPE_3_UNPROTECT_E;
+        Flash.erase_mode = ITE_ERASE_MODE_1_SECTOR_ERASE ;
+        Flash.write_type = 0; //ITE_PROGRAM_TYPE
+        Flash.write_mode = 3; //ITE_PROGRAM_MODE
+
+	memset(zero,0,sizeof(zero));
+	CALL_CHECK(connect_dbgr());
 	//CALL_CHECK(WriteNonSSTFlashStatus(0x82,0,0x2));
 	CALL_CHECK(WriteNonSSTFlashStatus(0xff,0,0));
 
-	//20220223 un-protect flash
-	CALL_CHECK(WriteReg(0x1f,0x05,0x30));
-	for(i=0;i<0x20;i++)
-		CALL_CHECK(WriteReg(0x20,0xa0+i,0x00));
+	//20220223 un-protect flash
+	CALL_CHECK(WriteReg(0x1f,0x05,0x30));
+	CALL_CHECK(WriteRegRange(0x20a0,zero,sizeof(zero)));
+
+	return r;
+
+}	
+
+int enter_spi(unsigned int step_ms)
+{
+
+        int r=0;
+
+        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_LOW);
+        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_OUTPUT);
+        ite_msleep(step_ms);
+
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_LOW);
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_OUTPUT);
+        ite_msleep(step_ms);
+
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_HIGH);
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_ALT);
+        ite_msleep(step_ms);
+
+        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_HIGH);
+        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_ALT);
+        return r;
+
+}	
+
+int reset_ec()
+{
+	int r;
+
+	CALL_CHECK(WriteReg(0x20,0x06,0x44));
+	CALL_CHECK(RunCtrl(0x80,0,0));
+
+	Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_LOW);
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_OUTPUT);
+        ite_msleep(g_wait.reset);
+        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_HIGH);
+
+	return r;
+}	
+
+void show_itedlb4()
+{
+        printf("\n\n\rITE DLB4 FW Version : %02x%02x",g_fw_ver[0],g_fw_ver[1]);
+        printf("\n\r===================================");
+	if(!(g_flag&ITE_USE_SPI)) {
+        	printf("\n\rCHIP ID          : %x%02x%02x",g_chip_id[0],g_chip_id[1],g_chip_id[2]);
+        	printf(" ( %x%02x%02x ) ",g_chip_id[3],g_chip_id[4],g_chip_id[5]);
+		if(g_chip!=NULL)
+			printf("\n\rEC Chip          : %s ( %d KB flash )",g_chip->name,g_chip->flash_size/1024);
+		else
+			printf("\n\rEC Chip          : unknown, assuming %d KB flash",g_geom.size/1024);
+	}
+        printf("\n\rFlash ID         : %02x %02x %02x\n\r",g_flash_id[0],g_flash_id[1],g_flash_id[2]);
+	if((g_flag&ITE_USE_SPI)) {
+		if(g_spi_part!=NULL)
+			printf("Flash Part       : %s ( %d KB, %s erase )\n\r",g_spi_part->name,g_spi_part->size/1024,
+				(Flash.erase_mode==ITE_ERASE_MODE_2_BLOCK_ERASE)?"block":"chip");
+		else
+			printf("Flash Part       : unknown, using default modes\n\r");
+	}
+}	
+
+#define ITE_HASH_INIT	0xcbf29ce484222325ULL
+
+// 64-bit FNV-1a, chain calls by passing the previous result as h
+uint64_t ite_hash(const unsigned char *buf,int len,uint64_t h)
+{
+	int i;
+
+	for(i=0;i<len;i++) {
+		h^=buf[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t image_hash()
+{
+	if(g_writebuf==NULL)
+		return 0;
+	if(g_index.blank!=NULL && g_index.buf==g_writebuf)
+		return g_index.hash;
+	return ite_hash(g_writebuf,g_file_size,ITE_HASH_INIT);
+}
+
+void usb_port_path(libusb_device *dev,char *path,int len)
+{
+	uint8_t ports[8];
+	int i,n,l;
+
+	if(dev==NULL) {
+		snprintf(path,len,"-");
+		return;
+	}
+	l=snprintf(path,len,"%d",libusb_get_bus_number(dev));
+	n=libusb_get_port_numbers(dev,ports,sizeof(ports));
+	for(i=0;i<n && l<len;i++)
+		l+=snprintf(path+l,len-l,"%c%d",(i==0)?'-':'.',ports[i]);
+}
+
+const char *usb_speed_name(int speed)
+{
+	switch(speed) {
+	case LIBUSB_SPEED_LOW:		return "low";
+	case LIBUSB_SPEED_FULL:		return "full";
+	case LIBUSB_SPEED_HIGH:		return "high";
+	case LIBUSB_SPEED_SUPER:	return "super";
+	default:			return "-";
+	}
+}
+
+// Start timing a run; per class command counts are taken relative to here
+void audit_begin()
+{
+	memset(g_phase_ms,0,sizeof(g_phase_ms));
+	memcpy(g_audit_stats,g_cmd_stats,sizeof(g_cmd_stats));
+	g_connect_retries=0;
+	g_audit_t0=now_ms();
+}
+
+// write s as the body of a JSON string
+void json_esc(FILE *fp,const char *s)
+{
+	for(;*s;s++) {
+		if(*s=='"' || *s=='\\')
+			fprintf(fp,"\\%c",*s);
+		else if((unsigned char)*s<0x20)
+			fprintf(fp,"\\u%04x",(unsigned char)*s);
+		else
+			fputc(*s,fp);
+	}
+}
+
+// Append one JSON line describing the run to the audit log
+void audit_log(int result)
+{
+	static const char *phase[ITE_PHASES]={"connect","erase","check","program","verify","repair","reset"};
+	static const char *name[ITE_CMD_CLASSES]={"ctrl","read","write","erase","chip_erase","ec"};
+	static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+	libusb_device *dev;
+	FILE *fp;
+	char host[64],port[32],stamp[32];
+	time_t now;
+	double total_ms;
+	int i,s,prog=0,repaired=0,fails=0;
+
+	if(g_audit_file==NULL)
+		return;
+	//--jobs boards finish concurrently, keep their lines whole
+	pthread_mutex_lock(&lock);
+	if((fp=fopen(g_audit_file,"a"))==NULL) {
+		printf("\n\ropen log file error : %s",g_audit_file);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	total_ms=now_ms()-g_audit_t0;
+	now=time(NULL);
+	strftime(stamp,sizeof(stamp),"%Y-%m-%dT%H:%M:%S",localtime(&now));
+	if(gethostname(host,sizeof(host)))
+		strcpy(host,"-");
+	host[sizeof(host)-1]=0;
+	dev=devinfo.handle?libusb_get_device(devinfo.handle):NULL;
+	usb_port_path(dev,port,sizeof(port));
+	for(s=0;s<g_sect_no;s++) {
+		if(g_sect_map[s]&ITE_SECT_ERASE)
+			prog+=g_geom.sector_size;
+		if(g_sect_map[s]&ITE_SECT_REPAIRED)
+			repaired++;
+	}
+	for(i=0;i<ITE_CMD_CLASSES;i++)
+		fails+=g_cmd_stats[i].fails-g_audit_stats[i].fails;
+
+	fprintf(fp,"{\"time\":\"%s\",\"station\":\"",stamp);
+	json_esc(fp,host);
+	fprintf(fp,"\",\"port\":\"");
+	json_esc(fp,port);
+	fprintf(fp,"\"");
+	fprintf(fp,",\"speed\":\"%s\"",usb_speed_name(dev?libusb_get_device_speed(dev):-1));
+	fprintf(fp,",\"fw\":\"%02x%02x\",\"iface\":\"%s\"",g_fw_ver[0],g_fw_ver[1],(g_flag&ITE_USE_SPI)?"spi":"i2c");
+	fprintf(fp,",\"chip\":\"%x%02x%02x\",\"flash\":\"%02x%02x%02x\"",g_chip_id[3],g_chip_id[4],g_chip_id[5],
+		g_flash_id[0],g_flash_id[1],g_flash_id[2]);
+	fprintf(fp,",\"image\":\"");
+	json_esc(fp,g_image_name?g_image_name:"-");
+	fprintf(fp,"\",\"size\":%d,\"hash\":\"%016llx\"",g_file_size,
+		(unsigned long long)image_hash());
+	fprintf(fp,",\"ms\":{");
+	for(i=0;i<ITE_PHASES;i++)
+		fprintf(fp,"%s\"%s\":%.0f",i?",":"",phase[i],g_phase_ms[i]);
+	fprintf(fp,",\"total\":%.0f}",total_ms);
+	fprintf(fp,",\"bytes\":%d,\"kbps\":%.1f,\"program_kbps\":%.1f",prog,(total_ms>0)?prog/total_ms:0,
+		(g_phase_ms[ITE_PHASE_PROGRAM]>0)?prog/g_phase_ms[ITE_PHASE_PROGRAM]:0);
+	fprintf(fp,",\"cmd\":{");
+	for(i=0;i<ITE_CMD_CLASSES;i++)
+		fprintf(fp,"%s\"%s\":[%d,%.1f]",i?",":"",name[i],g_cmd_stats[i].count-g_audit_stats[i].count,
+			g_cmd_stats[i].total_ms-g_audit_stats[i].total_ms);
+	fprintf(fp,"},\"retries\":{\"connect\":%d,\"usb\":%d,\"repaired\":%d}",g_connect_retries,fails,repaired);
+	fprintf(fp,",\"result\":\"%s\"}\n",(result==0)?"pass":(result>0)?"verify":"fail");
+	fclose(fp);
+	pthread_mutex_unlock(&lock);
+}
+
+// copy the string value of "key" from a log line written by audit_log()
+int json_str(char *line,char *key,char *val,int len)
+{
+	char pat[32];
+	char *p;
+	unsigned int c;
+	int n=0;
+
+	snprintf(pat,sizeof(pat),"\"%s\":\"",key);
+	if((p=strstr(line,pat))==NULL) {
+		snprintf(val,len,"-");
+		return -1;
+	}
+	//undo json_esc() up to the closing quote
+	for(p+=strlen(pat);*p && *p!='"';p++) {
+		c=*p;
+		if(c=='\\' && p[1]=='u' && sscanf(p+2,"%4x",&c)==1)
+			p+=5;
+		else if(c=='\\' && p[1])
+			c=*++p;
+		if(n<len-1)
+			val[n++]=c;
+	}
+	val[n]=0;
+	if(*p!='"') {
+		snprintf(val,len,"-");
+		return -1;
+	}
+	return 0;
+}
+
+double json_num(char *line,char *key)
+{
+	char pat[32];
+	char *p;
+
+	snprintf(pat,sizeof(pat),"\"%s\":",key);
+	if((p=strstr(line,pat))==NULL)
+		return 0;
+	return atof(p+strlen(pat));
+}
+
+// Summarize an audit log per station, port, DLB4 firmware and day
+int audit_summary(char *logfile)
+{
+	typedef struct {
+		char key[160];
+		int runs,fails;
+		double kbps,total_ms;
+	} LogGroup;
+	static LogGroup grp[256];
+	FILE *fp;
+	char line[2048],host[64],port[32],fw[8],stamp[32],key[160];
+	int i,n=0;
+
+	if((fp=fopen(logfile,"r"))==NULL) {
+		printf("\n\ropen log file error : %s\n\r",logfile);
+		return ITE_ERR;
+	}
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		json_str(line,"station",host,sizeof(host));
+		json_str(line,"port",port,sizeof(port));
+		json_str(line,"fw",fw,sizeof(fw));
+		json_str(line,"time",stamp,sizeof(stamp));
+		stamp[10]=0;
+		snprintf(key,sizeof(key),"%-20s %-12s %-6s %s",host,port,fw,stamp);
+		for(i=0;i<n && strcmp(grp[i].key,key);i++)
+			;
+		if(i==n) {
+			if(n==sizeof(grp)/sizeof(grp[0]))
+				continue;
+			strcpy(grp[n++].key,key);
+		}
+		grp[i].runs++;
+		if(strstr(line,"\"result\":\"pass\"")==NULL) {
+			grp[i].fails++;
+			continue;
+		}
+		grp[i].kbps+=json_num(line,"kbps");
+		grp[i].total_ms+=json_num(line,"total");
+	}
+	fclose(fp);
+
+	printf("\n\r%-20s %-12s %-6s %-10s %5s %5s %9s %8s\n\r","station","port","fw","date","runs","fail","KB/s","avg s");
+	for(i=0;i<n;i++) {
+		LogGroup *g=&grp[i];
+		int ok=g->runs-g->fails;
+		printf("%s %5d %5d %9.1f %8.1f\n\r",g->key,g->runs,g->fails,
+			ok?g->kbps/ok:0,ok?g->total_ms/ok/1000:0);
+	}
+	return 0;
+}
+
+// --verify-only: the main thread reads blocks into a ring of buffers while
+// workers hash and compare the blocks already read
+#define ITE_AUDIT_SLOTS		4
+#define ITE_AUDIT_WORKERS	4
+
+#define ITE_SLOT_FREE		0
+#define ITE_SLOT_READY		1
+#define ITE_SLOT_BUSY		2
+
+typedef struct _AuditPipe_
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *buf[ITE_AUDIT_SLOTS];
+	int blk[ITE_AUDIT_SLOTS];
+	int state[ITE_AUDIT_SLOTS];
+	int eof;
+	//workers have their own thread locals, everything they need is here
+	uint8_t *map;
+	uint64_t *hash;
+	uint64_t *ref_hash;
+	unsigned char *ref_img;
+	int ss;
+
+}AuditPipe;
+
+void audit_block(AuditPipe *ap,int blk,unsigned char *buf)
+{
+	int j,s;
+
+	for(j=0;j<65536/ap->ss;j++) {
+		s=blk*65536/ap->ss+j;
+		if(!(ap->map[s]&ITE_SECT_ERASE))
+			continue;
+		ap->hash[s]=ite_hash(buf+j*ap->ss,ap->ss,ITE_HASH_INIT);
+		if(ap->ref_img!=NULL && memcmp(buf+j*ap->ss,ap->ref_img+s*ap->ss,ap->ss))
+			ap->map[s]|=ITE_SECT_BAD;
+		else if(ap->ref_hash!=NULL && ap->ref_hash[s]!=ap->hash[s])
+			ap->map[s]|=ITE_SECT_BAD;
+	}
+}
+
+void *audit_worker(void *arg)
+{
+	AuditPipe *ap=(AuditPipe *)arg;
+	int i;
+
+	pthread_mutex_lock(&ap->lock);
+	for(;;) {
+		for(i=0;i<ITE_AUDIT_SLOTS && ap->state[i]!=ITE_SLOT_READY;i++)
+			;
+		if(i==ITE_AUDIT_SLOTS) {
+			if(ap->eof)
+				break;
+			pthread_cond_wait(&ap->cond,&ap->lock);
+			continue;
+		}
+		ap->state[i]=ITE_SLOT_BUSY;
+		pthread_mutex_unlock(&ap->lock);
+		audit_block(ap,ap->blk[i],ap->buf[i]);
+		pthread_mutex_lock(&ap->lock);
+		ap->state[i]=ITE_SLOT_FREE;
+		pthread_cond_broadcast(&ap->cond);
+	}
+	pthread_mutex_unlock(&ap->lock);
+
+	return NULL;
+}
+
+// Hash manifest, one line per sector ('#' starts a comment):
+//   <flash offset> <64-bit FNV-1a of the sector>
+// Listed sectors are planned and their hashes stored in ref.
+int load_hash_manifest(char *file,uint64_t *ref)
+{
+	FILE *fp;
+	char line[256];
+	unsigned int offset;
+	unsigned long long h;
+	int n=0,s;
+
+	if((fp=fopen(file,"r"))==NULL) {
+		printf("\n\ropen hash manifest error : %s",file);
+		return ITE_ERR;
+	}
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		n++;
+		if(line[0]=='#' || sscanf(line,"%i %llx",&offset,&h)!=2)
+			continue;
+		s=offset/g_geom.sector_size;
+		if(offset%g_geom.sector_size || s>=g_sect_no) {
+			printf("\n\r%s:%d: 0x%x is not a sector of this flash",file,n,offset);
+			fclose(fp);
+			return ITE_ERR;
+		}
+		ref[s]=h;
+		g_sect_map[s]|=ITE_SECT_ERASE;
+	}
+	fclose(fp);
+	return 0;
+}
+
+int save_hash_manifest(char *file,uint64_t *hash)
+{
+	FILE *fp;
+	int s;
+
+	if(strcmp(file,"-")==0)
+		fp=stdout;
+	else if((fp=fopen(file,"w"))==NULL) {
+		printf("\n\ropen hash manifest error : %s",file);
+		return ITE_ERR;
+	}
+	fprintf(fp,"# chip %x%02x%02x flash %02x%02x%02x size %d sector %d\n",g_chip_id[3],g_chip_id[4],g_chip_id[5],
+		g_flash_id[0],g_flash_id[1],g_flash_id[2],g_geom.size,g_geom.sector_size);
+	for(s=0;s<g_sect_no;s++) {
+		if(g_sect_map[s]&ITE_SECT_ERASE)
+			fprintf(fp,"0x%06x %016llx%s\n",s*g_geom.sector_size,(unsigned long long)hash[s],
+				(g_sect_map[s]&ITE_SECT_BAD)?" # differs":"");
+	}
+	if(fp!=stdout)
+		fclose(fp);
+	return 0;
+}
+
+// Read the planned sectors back without changing the flash and compare
+// them with the image or the hash manifest. With neither, the whole flash
+// is read. Returns the number of sectors that differ, or -1.
+int verify_only()
+{
+	AuditPipe ap;
+	pthread_t tid[ITE_AUDIT_WORKERS];
+	uint64_t *ref=NULL;
+	double t0;
+	int i,blk,blk_no,n=0,done=0,workers=0,bad=0,r=0;
+
+	if(g_region_no==0 && g_hash_ref==NULL)
+		memset(g_sect_map,ITE_SECT_ERASE,g_sect_no);
+	memset(&ap,0,sizeof(ap));
+	ap.hash=calloc(g_sect_no,sizeof(uint64_t));
+	if(g_hash_ref!=NULL) {
+		ref=calloc(g_sect_no,sizeof(uint64_t));
+		if(load_hash_manifest(g_hash_ref,ref)) {
+			free(ref);
+			free(ap.hash);
+			return -1;
+		}
+	}
+	ap.map=g_sect_map;
+	ap.ref_hash=ref;
+	ap.ref_img=g_region_no?g_writebuf:NULL;
+	ap.ss=g_geom.sector_size;
+	pthread_mutex_init(&ap.lock,NULL);
+	pthread_cond_init(&ap.cond,NULL);
+	for(i=0;i<ITE_AUDIT_SLOTS;i++)
+		ap.buf[i]=malloc(65536);
+
+	blk_no=g_geom.size/65536;
+	for(blk=0;blk<blk_no;blk++) {
+		if(blk_planned(blk,ITE_SECT_ERASE))
+			n++;
+	}
+	i=sysconf(_SC_NPROCESSORS_ONLN);
+	for(;workers<ITE_AUDIT_WORKERS && workers<i;workers++) {
+		if(pthread_create(&tid[workers],NULL,audit_worker,&ap))
+			break;
+	}
+	if(workers==0) {
+		//no threads, hash in line below
+		ap.eof=1;
+	}
+
+	t0=now_ms();
+	for(blk=0;blk<blk_no;blk++) {
+		if(blk_planned(blk,ITE_SECT_ERASE)==0)
+			continue;
+		pthread_mutex_lock(&ap.lock);
+		for(;;) {
+			for(i=0;i<ITE_AUDIT_SLOTS && ap.state[i]!=ITE_SLOT_FREE;i++)
+				;
+			if(i<ITE_AUDIT_SLOTS)
+				break;
+			pthread_cond_wait(&ap.cond,&ap.lock);
+		}
+		pthread_mutex_unlock(&ap.lock);
+
+		r=readflash(blk,Flash.read_mode,ap.buf[i]);
+		if(r<0)
+			break;
+		if(workers==0) {
+			audit_block(&ap,blk,ap.buf[i]);
+		} else {
+			pthread_mutex_lock(&ap.lock);
+			ap.blk[i]=blk;
+			ap.state[i]=ITE_SLOT_READY;
+			pthread_cond_broadcast(&ap.cond);
+			pthread_mutex_unlock(&ap.lock);
+		}
+		printf("\rReading...       : %d%%",(++done)*100/n);
+		fflush(stdout);
+	}
+	pthread_mutex_lock(&ap.lock);
+	ap.eof=1;
+	pthread_cond_broadcast(&ap.cond);
+	pthread_mutex_unlock(&ap.lock);
+	for(i=0;i<workers;i++)
+		pthread_join(tid[i],NULL);
+	printf("\n\r");
+
+	if(r>=0) {
+		for(i=0;i<g_sect_no;i++) {
+			if(g_sect_map[i]&ITE_SECT_BAD)
+				bad++;
+		}
+		printf("Verify only      : %d KB in %.1f s ( %.0f KB/s ), ",done*64,(now_ms()-t0)/1000,
+			done*64000/(now_ms()-t0+1));
+		if(ap.ref_img==NULL && ref==NULL)
+			printf("no reference\n\r");
+		else
+			printf("%d sectors differ\n\r",bad);
+		show_sect_ranges(ITE_SECT_BAD,"Differs          ");
+		if(g_hash_out!=NULL)
+			save_hash_manifest(g_hash_out,ap.hash);
+	}
+
+	for(i=0;i<ITE_AUDIT_SLOTS;i++)
+		free(ap.buf[i]);
+	pthread_mutex_destroy(&ap.lock);
+	pthread_cond_destroy(&ap.cond);
+	free(ap.hash);
+	free(ref);
+	return (r<0)?-1:bad;
+}
+
+int connect_ec()
+{
+	int r=0;
+	int loop=0;
+	
+	g_chip_id[0]=0x00;
+	printf("\n\rConnecting ITE Device....");
+	
+	if((g_flag&ITE_USE_SPI)) {
+	        printf("\n\rFlash via SPI interface...");
+		init_dlb4_spi();
+		if(select_spi_part()) 
+			return -1;
+	} else if((g_flag&ITE_VERIFY_ONLY)) {
+		//audit: debugger connect only, the protection and status are left as they are
+		if(connect_dbgr_retry(2000)) {
+                	printf("\n\rGet Chip ERR! Please re-run the program");
+                	return -1;
+		}
+	} else {
+		g_special_ms=g_wait.special;
+		do {
+			CALL_CHECK(init_dlb4());
+			if(g_chip_id[0]!=0x00) {
+				break;
+			}
+			printf(".");
+                	fflush(stdout);
+			g_connect_retries++;
+			//EC did not enter debug mode, give the waveform longer next time
+			if(g_special_ms<ITE_WAIT_SPECIAL_MAX)
+				g_special_ms=(g_special_ms*2<ITE_WAIT_SPECIAL_MAX)?g_special_ms*2:ITE_WAIT_SPECIAL_MAX;
+		}while(loop++ < 2000);
+
+        	if(g_chip_id[0]==0) {
+                	printf("\n\rGet Chip ERR! Please re-run the program");
+                	return -1;
+        	}
+
+	}
+
+	return r;
+}	
+
+// Erase, check, program and verify the planned sectors.
+// Returns the number of sectors still bad after verify, or -1.
+int flash_planned()
+{
+	int r=0;
+
+	g_blank_ready=0;
+	PHASE_CALL(ITE_PHASE_ERASE,eraseall());
+	if(!g_blank_ready)
+		build_blank_map();
+	if(!(g_flag&ITE_SKIP_CHECK))
+		PHASE_CALL(ITE_PHASE_CHECK,checkall());
+	PHASE_CALL(ITE_PHASE_PROGRAM,programall());
+	if(!(g_flag&ITE_SKIP_VERIFY)) {
+		PHASE_CALL(ITE_PHASE_VERIFY,verifyall());
+		if(r>0 && (g_flag&ITE_REPAIR))
+			PHASE_CALL(ITE_PHASE_REPAIR,repairall());
+		return r;
+	}
+	return 0;
+}	
+
+// Apply --patch on top of what is in flash: read back the blocks under the
+// patches, patch them in memory and erase, program and verify only the
+// sectors whose content changes. The image buffers and plan of the run
+// are put back afterwards. Returns the number of bad sectors, or -1.
+int patch_flash()
+{
+	unsigned char *img_wbuf=g_writebuf,*img_rbuf=g_readbuf;
+	int img_blk_no=g_blk_no,img_flash_size=g_flash_size;
+	uint8_t *img_map;
+	uint32_t end;
+	int i,s,blk,blk_no=0,n=0,r=0,bytes=0,saved=0;
+	int ss=g_geom.sector_size;
+
+	for(i=0;i<g_patch_no;i++) {
+		end=g_patch[i].offset+g_patch[i].size;
+		if(end>(uint32_t)g_geom.size) {
+			printf("\n\rPatch 0x%x+0x%x exceeds flash size %d",g_patch[i].offset,g_patch[i].size,g_geom.size);
+			return -1;
+		}
+		if((int)((end-1)/65536+1)>blk_no)
+			blk_no=(end-1)/65536+1;
+		bytes+=g_patch[i].size;
+	}
+
+	img_map=malloc(g_sect_no);
+	g_writebuf=malloc(blk_no*65536);
+	g_readbuf=malloc(blk_no*65536);
+	if(img_map==NULL || g_writebuf==NULL || g_readbuf==NULL) {
+		printf("\n\ralloc patch buffers fail");
+		r=-1;
+		goto out;
+	}
+	memcpy(img_map,g_sect_map,g_sect_no);
+	memset(g_sect_map,0,g_sect_no);
+	saved=1;
+	g_blk_no=blk_no;
+	g_flash_size=blk_no*65536;
+
+	//current flash content of every block a patch touches
+	for(blk=0;blk<blk_no;blk++) {
+		for(i=0;i<g_patch_no;i++) {
+			if(g_patch[i].offset<(blk+1)*65536 && g_patch[i].offset+g_patch[i].size>blk*65536)
+				break;
+		}
+		if(i==g_patch_no)
+			continue;
+		r=readflash(blk,Flash.read_mode,g_readbuf+blk*65536);
+		if(r<0)
+			goto out;
+		memcpy(g_writebuf+blk*65536,g_readbuf+blk*65536,65536);
+		for(i=0;i<g_patch_no;i++) {
+			if(g_patch[i].offset<(blk+1)*65536 && g_patch[i].offset+g_patch[i].size>blk*65536)
+				memcpy(g_writebuf+g_patch[i].offset,g_patch[i].data,g_patch[i].size);
+		}
+		for(s=blk*65536/ss;s<(blk+1)*65536/ss;s++) {
+			if(memcmp(g_writebuf+s*ss,g_readbuf+s*ss,ss)) {
+				g_sect_map[s]=ITE_SECT_ERASE;
+				n++;
+			}
+		}
+	}
+
+	if(n==0) {
+		printf("\n\rPatch            : already in flash\n\r");
+		r=0;
+		goto out;
+	}
+	printf("\n\rPatch            : %d bytes in %d sectors\n\r",bytes,n);
+	show_sect_ranges(ITE_SECT_ERASE,"Patch sectors    ");
+	//never chip erase for a patch
+	if(Flash.erase_mode==ITE_ERASE_MODE_0_CHIP_ERASE)
+		Flash.erase_mode=ITE_ERASE_MODE_2_BLOCK_ERASE;
+	r=flash_planned();
+out:
+	if(saved) {
+		//the run's plan, plus the patched sectors for the audit log
+		for(s=0;s<g_sect_no;s++)
+			img_map[s]|=g_sect_map[s]&(ITE_SECT_ERASE|ITE_SECT_BAD|ITE_SECT_REPAIRED);
+		memcpy(g_sect_map,img_map,g_sect_no);
+	}
+	free(img_map);
+	free(g_writebuf);
+	free(g_readbuf);
+	g_writebuf=img_wbuf;
+	g_readbuf=img_rbuf;
+	g_blk_no=img_blk_no;
+	g_flash_size=img_flash_size;
+	return r;
+}
+
+void save_target(TargetState *t)
+{
+	t->writebuf=g_writebuf;
+	t->readbuf=g_readbuf;
+	t->sect_map=g_sect_map;
+	t->sect_no=g_sect_no;
+	memcpy(t->region,g_region,sizeof(t->region));
+	t->region_no=g_region_no;
+	t->file_size=g_file_size;
+	t->flash_size=g_flash_size;
+	t->blk_no=g_blk_no;
+	t->win_offset=g_win_offset;
+	t->win_length=g_win_length;
+	t->geom=g_geom;
+	t->flash=Flash;
+	t->spi_part=g_spi_part;
+	memcpy(t->flash_id,g_flash_id,sizeof(t->flash_id));
+	t->index=g_index;
+}
+
+void restore_target(TargetState *t)
+{
+	g_writebuf=t->writebuf;
+	g_readbuf=t->readbuf;
+	g_sect_map=t->sect_map;
+	g_sect_no=t->sect_no;
+	memcpy(g_region,t->region,sizeof(g_region));
+	g_region_no=t->region_no;
+	g_file_size=t->file_size;
+	g_flash_size=t->flash_size;
+	g_blk_no=t->blk_no;
+	g_win_offset=t->win_offset;
+	g_win_length=t->win_length;
+	g_geom=t->geom;
+	Flash=t->flash;
+	g_spi_part=t->spi_part;
+	memcpy(g_flash_id,t->flash_id,sizeof(g_flash_id));
+	g_index=t->index;
+}
+
+// --external: after the internal flash, select the SPI flash behind the EC
+// through the debugger and program it in the same session, so the board is
+// connected and reset once. The internal target is put back afterwards and
+// the flash selection returned to internal.
+// Returns the number of bad sectors, or -1.
+int flash_external()
+{
+	TargetState internal;
+	int r;
+
+	save_target(&internal);
+	g_writebuf=NULL;
+	g_readbuf=NULL;
+	g_sect_map=NULL;
+	g_region_no=0;
+	g_win_offset=0;
+	g_win_length=0;
+	g_spi_part=NULL;
+	memset(&g_index,0,sizeof(g_index));
+	g_blk_no=16;
+	g_external=1;
+
+	printf("\n\rSwitching to external flash...");
+	r=-1;
+	if(StartD2ec(11)==0 && GetFlashID(g_flash_id,4)==0 && WriteNonSSTFlashStatus(0xff,0,0)==0 &&
+	   init_file(g_ext_image)==0) {
+		select_spi_part();
+		r=plan_flash();
+		printf("\n\rExternal Flash ID: %02x %02x %02x\n\r",g_flash_id[0],g_flash_id[1],g_flash_id[2]);
+		if(g_spi_part!=NULL)
+			printf("Flash Part       : %s ( %d KB, %s erase )\n\r",g_spi_part->name,g_spi_part->size/1024,
+				(Flash.erase_mode==ITE_ERASE_MODE_2_BLOCK_ERASE)?"block":"chip");
+		else
+			printf("Flash Part       : unknown, using default modes\n\r");
+		if(r==0)
+			r=flash_planned();
+		else
+			r=-1;
+		if(r>=0)
+			WriteNonSSTFlashStatus(0x82,0,0x2);
+	}
+	StartD2ec(0x0a); //back to the internal flash
+
+	exit_file();
+	g_external=0;
+	restore_target(&internal);
+	return r;
+}
+
+int do_iteflash()
+{
+	int r=0;
+	int bad=0;
+
+	PHASE_CALL(ITE_PHASE_CONNECT,connect_ec());
+
+	r=plan_flash();
+	show_itedlb4();	
+	if(r)
+		return -1;
+	lock_buffers(NULL,0);
+
+	if((g_flag&ITE_VERIFY_ONLY)) {
+		PHASE_CALL(ITE_PHASE_VERIFY,verify_only());
+		bad=r;
+	} else {
+		if(g_region_no) {
+			CALL_CHECK(flash_planned());
+			bad=r;
+		}
+		if(g_patch_no && bad==0) {
+			CALL_CHECK(patch_flash());
+			bad=r;
+		}
+
+		//Enable QE Bit After flash
+		PHASE_CALL(ITE_PHASE_RESET,WriteNonSSTFlashStatus(0x82,0,0x2));
+
+		if(g_ext_image != NULL && bad==0) {
+			CALL_CHECK(flash_external());
+			bad=r;
+		}
+	}
+
+	if((g_flag&ITE_VERIFY_ONLY) && !(g_flag&ITE_USE_SPI)) {
+		PHASE_CALL(ITE_PHASE_RESET,RunCtrl(0x80,0,0)); //let the EC run on, no reset
+	} else {
+		PHASE_CALL(ITE_PHASE_RESET,reset_ec());
+	}
+
+	if(bad>0)
+		return 1;
+	return r;
+
+}	
+
+// Re-read the image after a change and plan only the sectors that differ
+// from what was last written, or every sector when stale is set.
+// Returns the number of changed sectors.
+int reload_changed(char *filename,int stale)
+{
+	unsigned char *buf;
+	long file_size;
+	int blk_no,size,s,n=0;
+	int ss=g_geom.sector_size;
+
+        if ( (fi=fopen(filename,"rb"))==NULL) {
+                printf("open file error : %s \n",filename);
+		return -1;
+	}
+        fseek(fi,0,SEEK_END);
+        file_size = ftell(fi);
+        fseek(fi,0,SEEK_SET);
+	if(file_size>g_geom.size) {
+		printf("\n\rImage size %ld exceeds flash size %d, ignored",file_size,g_geom.size);
+		fclose(fi);
+		return -1;
+	}
+
+	//keep the larger of the old and new image so a shrunk image erases its old tail
+	blk_no=(file_size+g_blk_size-1)/g_blk_size;
+	if(blk_no<g_blk_no)
+		blk_no=g_blk_no;
+	size=blk_no*g_blk_size;
+	buf=malloc(size);
+	if(buf==NULL) {
+		fclose(fi);
+		return -1;
+	}
+	memset(buf,0xFF,size);
+	if(fread(buf,1,file_size,fi)!=file_size) {
+		printf("read file error : %s \n",filename);
+		free(buf);
+		fclose(fi);
+		return -1;
+	}
+	fclose(fi);
+	fi=NULL;
+
+	if(size>g_flash_size) {
+		g_writebuf=realloc(g_writebuf,size);
+		g_readbuf=realloc(g_readbuf,size);
+		memset(g_writebuf+g_flash_size,0xFF,size-g_flash_size);
+		g_flash_size=size;
+		g_blk_no=blk_no;
+	}
+
+	for(s=0;s<g_sect_no;s++) {
+		g_sect_map[s]=0;
+		if(s*ss>=size)
+			continue;
+		if(stale || memcmp(buf+s*ss,g_writebuf+s*ss,ss)) {
+			g_sect_map[s]=ITE_SECT_ERASE;
+			n++;
+		}
+	}
+	memcpy(g_writebuf,buf,size);
+	free(buf);
+	g_file_size=file_size;
+	g_region[0].size=file_size;
+	free_index();
+
+	return n;
+}
+
+// Development loop: keep the DLB4 open, wait for the image to be rewritten
+// and flash only the sectors that changed, then reset the EC. With stale
+// set (the first flash did not verify) the first update rewrites it all.
+int watch_image(char *filename,int stale)
+{
+	char dir[256],name[256];
+	char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	struct pollfd pfd;
+	int fd,len,n,r=0,hit;
+	double t0;
+
+	strncpy(dir,filename,sizeof(dir)-1);
+	strncpy(name,filename,sizeof(name)-1);
+	dir[sizeof(dir)-1]=0;
+	name[sizeof(name)-1]=0;
+
+	//watch the directory, build tools usually replace the file
+	fd=inotify_init1(IN_NONBLOCK);
+	if(fd<0 || inotify_add_watch(fd,dirname(dir),IN_CLOSE_WRITE|IN_MOVED_TO)<0) {
+		perror("inotify");
+		return -1;
+	}
+	strcpy(name,basename(name));
+	pfd.fd=fd;
+	pfd.events=POLLIN;
+
+	signal(SIGINT,stop_request);
+	signal(SIGTERM,stop_request);
+
+	while(!g_stop) {
+		printf("\n\rWatching %s for changes...\n\r",filename);
+		fflush(stdout);
+
+		hit=0;
+		while(!hit && !g_stop) {
+			if(poll(&pfd,1,-1)<=0)
+				continue;
+			while((len=read(fd,ev,sizeof(ev)))>0) {
+				for(ie=(struct inotify_event *)ev;(char *)ie<ev+len;
+				    ie=(struct inotify_event *)((char *)ie+sizeof(*ie)+ie->len)) {
+					if(ie->len && strcmp(ie->name,name)==0)
+						hit=1;
+				}
+			}
+		}
+		if(g_stop)
+			break;
+
+		//let the writer finish before reading the image
+		while(poll(&pfd,1,200)>0) {
+			while(read(fd,ev,sizeof(ev))>0)
+				;
+		}
+
+		t0=now_ms();
+		audit_begin();
+		n=reload_changed(filename,stale);
+		if(n<0)
+			continue;
+		show_time();
+		printf("Image changed    : %d sectors\n\r",n);
+		if(n==0)
+			continue;
+
+		r=connect_ec();
+		g_phase_ms[ITE_PHASE_CONNECT]=now_ms()-t0;
+		if(r==0) {
+			//never chip erase for an update
+			if(Flash.erase_mode==ITE_ERASE_MODE_0_CHIP_ERASE)
+				Flash.erase_mode=ITE_ERASE_MODE_2_BLOCK_ERASE;
+			r=flash_planned();
+		}
+		if(r==0) {
+			WriteNonSSTFlashStatus(0x82,0,0x2);
+			reset_ec();
+			printf("Updated in %.1f s\n\r",(now_ms()-t0)/1000);
+			stale=0;
+		} else {
+			//flash contents unknown now, rewrite the whole image next time
+			printf("Update FAIL, whole image is flashed on the next change\n\r");
+			stale=1;
+		}
+		audit_log(r);
+	}
+
+	close(fd);
+	return r;
+}
+
+
+// Per command cost in ms for the dry run estimate: averages of the "cmd"
+// counters of passing runs on the same interface in the audit log, or
+// rough DLB4 defaults. Returns the number of runs used.
+int calibrate_cost(double *cost)
+{
+	static const char *name[ITE_CMD_CLASSES]={"ctrl","read","write","erase","chip_erase","ec"};
+	static const double dflt[ITE_CMD_CLASSES]={0.5,70,120,25,0,0.5};
+	double ms[ITE_CMD_CLASSES]={0},ms1;
+	int cnt[ITE_CMD_CLASSES]={0},cnt1;
+	char line[2048],pat[32],iface[8];
+	char *p;
+	FILE *fp;
+	int i,runs=0;
+
+	for(i=0;i<ITE_CMD_CLASSES;i++)
+		cost[i]=dflt[i];
+	cost[ITE_CMD_CHIP_ERASE]=erase_expect_ms(ITE_CMD_CHIP_ERASE);
+
+	if(g_audit_file==NULL || (fp=fopen(g_audit_file,"r"))==NULL)
+		return 0;
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		json_str(line,"iface",iface,sizeof(iface));
+		if(strstr(line,"\"result\":\"pass\"")==NULL || strcmp(iface,(g_flag&ITE_USE_SPI)?"spi":"i2c"))
+			continue;
+		runs++;
+		for(i=0;i<ITE_CMD_CLASSES;i++) {
+			snprintf(pat,sizeof(pat),"\"%s\":[",name[i]);
+			if((p=strstr(line,pat))!=NULL && sscanf(p+strlen(pat),"%d,%lf",&cnt1,&ms1)==2) {
+				cnt[i]+=cnt1;
+				ms[i]+=ms1;
+			}
+		}
+	}
+	fclose(fp);
+
+	for(i=0;i<ITE_CMD_CLASSES;i++) {
+		if(cnt[i])
+			cost[i]=ms[i]/cnt[i];
+	}
+	return runs;
+}
+
+// Plan the run without a device and estimate its time from the cost model
+int dry_run()
+{
+	static const char *name[ITE_CMD_CLASSES]={"ctrl","read","write","erase","chip erase","ec"};
+	double cost[ITE_CMD_CLASSES];
+	double total;
+	int i,r,runs;
+
+	if(g_dry_target==0)
+		g_dry_target=(g_flag&ITE_USE_SPI)?0xc86514:0x81302;
+	printf("\n\rDry run, no device is touched. Target %x",g_dry_target);
+
+	r=g_reg_no?reg_access():do_iteflash();
+
+	runs=calibrate_cost(cost);
+	total=g_dry_sleep_ms;
+	printf("\n\rDry run plan     :");
+	for(i=0;i<ITE_CMD_CLASSES;i++) {
+		if(g_dry_count[i]==0)
+			continue;
+		printf("\n\r  %-10s     : %6d x %8.2f ms = %8.0f ms",name[i],g_dry_count[i],cost[i],g_dry_count[i]*cost[i]);
+		total+=g_dry_count[i]*cost[i];
+	}
+	printf("\n\r  %-10s     : %26s %8.0f ms","sleeps","",g_dry_sleep_ms);
+	printf("\n\rEstimated time   : %.1f s ( %s )\n\r",total/1000,
+		runs?"calibrated from the audit log":"default costs, use -l to calibrate");
+	if(runs)
+		printf("Calibration runs : %d\n\r",runs);
+
+	free(g_dry_flash);
+	g_dry_flash=NULL;
+	return (r<0)?r:0;
+}
+
+int ite_session(libusb_device_handle *handle)
+{
+	int r=0;
+	uint8_t endpoint_in = 0, endpoint_out = 0;	// default IN and OUT endpoints
+
+	endpoint_in = 0x81;
+	endpoint_out = 0x02;
+	devinfo.handle = handle;
+	devinfo.endpoint_in = endpoint_in;
+	devinfo.endpoint_out = endpoint_out;
+	//CALL_CHECK(do_iteflash());
+	if(g_reg_no) {
+		r=reg_access();
+	} else {
+		audit_begin();
+		r=do_iteflash();
+		audit_log(r);
+		if(r>=0 && (g_flag&ITE_WATCH))
+			r=watch_image(g_region[0].filename,r>0); //verify failed, rewrite all next time
+	}
+	show_health();
+	ITE_DBG("Closing device...\n");
+	libusb_close(handle);
+	devinfo.handle = NULL;
+
+	return r;
+}	
+
+int ite_device(uint16_t vid, uint16_t pid)
+{
+	libusb_device_handle *handle;
+
+	ITE_DBG("\n\rOpening device...\n");
+	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+
+	if (handle == NULL) {
+		perr("  Failed.\n");
+		return -1;
+	}
+
+	return ite_session(handle);
+}	
+
+// the callback may run on the --low-jitter event thread
+static pthread_mutex_t hotplug_lock=PTHREAD_MUTEX_INITIALIZER;
+
+static int LIBUSB_CALL hotplug_arrived(libusb_context *ctx, libusb_device *dev,
+				libusb_hotplug_event event, void *user_data)
+{
+	int i;
+
+	//no I/O allowed in the callback, station_mode() picks the boards up in turn
+	pthread_mutex_lock(&hotplug_lock);
+	for(i=0;i<g_hotplug_no && g_hotplug_dev[(g_hotplug_head+i)%ITE_HOTPLUG_MAX]!=dev;i++)
+		;
+	if(i==g_hotplug_no && g_hotplug_no<ITE_HOTPLUG_MAX) {
+		g_hotplug_dev[(g_hotplug_head+g_hotplug_no)%ITE_HOTPLUG_MAX]=libusb_ref_device(dev);
+		g_hotplug_no++;
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+	return 0;
+}
+
+// next queued board, or NULL
+libusb_device *hotplug_next()
+{
+	libusb_device *dev=NULL;
+
+	pthread_mutex_lock(&hotplug_lock);
+	if(g_hotplug_no) {
+		dev=g_hotplug_dev[g_hotplug_head];
+		g_hotplug_head=(g_hotplug_head+1)%ITE_HOTPLUG_MAX;
+		g_hotplug_no--;
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+	return dev;
+}
+
+// Production station: flash every DLB4 the moment it enumerates, log the
+// result and go back to waiting. Boards already attached at start-up are
+// reported through LIBUSB_HOTPLUG_ENUMERATE.
+int station_mode()
+{
+	libusb_hotplug_callback_handle cb;
+	libusb_device_handle *handle;
+	libusb_device *dev=NULL;
+	double t0;
+	int r,unit=0,pass=0;
+
+	if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		printf("\n\rhotplug is not supported by this libusb\n\r");
+		return -1;
+	}
+
+	r=libusb_hotplug_register_callback(NULL,LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_ENUMERATE,VID,PID,LIBUSB_HOTPLUG_MATCH_ANY,
+			hotplug_arrived,NULL,&cb);
+	if(r!=LIBUSB_SUCCESS) {
+		perr("   %s\n",libusb_strerror((enum libusb_error)r));
+		return -1;
+	}
+
+	signal(SIGINT,stop_request);
+	signal(SIGTERM,stop_request);
+
+	while(!g_stop) {
+		dev=hotplug_next();
+		if(dev==NULL) {
+			printf("\n\rWaiting for ITE DLB4 board...\n\r");
+			fflush(stdout);
+			while((dev=hotplug_next())==NULL && !g_stop)
+				libusb_handle_events(NULL);
+			if(g_stop)
+				break;
+		}
+
+		unit++;
+		t0=now_ms();
+		r=libusb_open(dev,&handle);
+		if(r==LIBUSB_SUCCESS)
+			r=ite_session(handle);
+		else
+			perr("   %s\n",libusb_strerror((enum libusb_error)r));
+		libusb_unref_device(dev);
+		dev=NULL;
+
+		if(r==0)
+			pass++;
+		printf("\n\rUnit %d : %s ( %.1f s, %d/%d passed ) ",unit,(r==0)?"PASS":"FAIL",
+			(now_ms()-t0)/1000,pass,unit);
+		show_time();
+	}
+
+	libusb_hotplug_deregister_callback(NULL,cb);
+	if(dev!=NULL)
+		libusb_unref_device(dev);
+	while((dev=hotplug_next())!=NULL)
+		libusb_unref_device(dev);
+	printf("\n\rStation stopped: %d/%d units passed\n\r",pass,unit);
+
+	return (pass==unit)?0:1;
+}
+
+
+typedef struct _IdentifyJob_
+{
+	libusb_device *dev;
+	char port[32];
+	unsigned char fw_ver[4];
+	unsigned char chip_id[6];
+	unsigned char flash_id[6];
+	int flag;               //g_flag of the caller, g_flag is per thread
+	int result;
+
+}IdentifyJob;
+
+// connect_dbgr() until the EC answers with a chip ID, lengthening the
+// special waveform after each miss. Nothing is erased or unprotected.
+int connect_dbgr_retry(int tries)
+{
+	int r,loop=0;
+
+	g_special_ms=g_wait.special;
+	do {
+		g_chip_id[0]=0;
+		r=connect_dbgr();
+		if(g_special_ms<ITE_WAIT_SPECIAL_MAX)
+			g_special_ms=(g_special_ms*2<ITE_WAIT_SPECIAL_MAX)?g_special_ms*2:ITE_WAIT_SPECIAL_MAX;
+	} while(r==0 && g_chip_id[0]==0 && loop++<tries);
+	if(r==0 && g_chip_id[0]==0)
+		r=ITE_ERR;
+
+	return r;
+}
+
+// Minimal connect on the open board: firmware version, chip and flash IDs.
+// The EC is let run again afterwards.
+int probe_board()
+{
+	int r;
+
+	if((g_flag&ITE_USE_SPI))
+		return init_dlb4_spi();
+	r=connect_dbgr_retry(20);
+	if(r==0)
+		RunCtrl(0x80,0,0);
+
+	return r;
+}
+
+// --peek/--poke: connect the debugger, run the accesses in command line
+// order and let the EC run again. The flash is not touched.
+int reg_access()
+{
+	uint8_t *buf;
+	double t0;
+	int i,j,r;
+	RegAccess *ra;
+
+	if((g_flag&ITE_USE_SPI)) {
+		printf("\n\r--peek/--poke need the I2C debugger interface\n\r");
+		return -1;
+	}
+	printf("\n\rConnecting ITE Device....");
+	r=connect_dbgr_retry(2000);
+	if(r) {
+		printf("\n\rGet Chip ERR! Please re-run the program");
+		return -1;
+	}
+	printf("\n\rCHIP ID          : %x%02x%02x\n\r",g_chip_id[3],g_chip_id[4],g_chip_id[5]);
+
+	for(i=0;i<g_reg_no && r>=0;i++) {
+		ra=&g_reg[i];
+		buf=ra->data?ra->data:malloc(ra->len);
+		t0=now_ms();
+		if(ra->data)
+			r=WriteRegRange(ra->addr,buf,ra->len);
+		else
+			r=ReadRegRange(ra->addr,buf,ra->len);
+		printf("\n\r%s 0x%04x+0x%x : %s ( %.1f ms )\n\r",ra->data?"Poke":"Peek",ra->addr,ra->len,
+			(r<0)?"FAIL":"ok",now_ms()-t0);
+		if(r>=0 && ra->data==NULL) {
+			for(j=0;j<ra->len;j++) {
+				if(j==0 || (ra->addr+j)%16==0)
+					printf("%s %04X :",j?"\n\r":"",(ra->addr+j)&~0xf);
+				if(j==0)
+					printf("%*s",((ra->addr)%16)*3+((ra->addr%16)>7?2:0),"");
+				printf(" %02x",buf[j]);
+				if((ra->addr+j)%16==7)
+					printf(" - ");
+			}
+			printf("\n\r");
+		}
+		if(ra->data==NULL)
+			free(buf);
+	}
+	RunCtrl(0x80,0,0);
+
+	return (r<0)?r:0;
+}
+
+void *identify_board(void *arg)
+{
+	IdentifyJob *job=(IdentifyJob *)arg;
+	libusb_device_handle *handle;
+	int r;
+
+	g_flag=job->flag;
+	set_interface();
+	job->result=libusb_open(job->dev,&handle);
+	if(job->result!=LIBUSB_SUCCESS)
+		return NULL;
+	devinfo.handle=handle;
+	devinfo.endpoint_in=0x81;
+	devinfo.endpoint_out=0x02;
+
+	r=probe_board();
+	memcpy(job->fw_ver,g_fw_ver,sizeof(job->fw_ver));
+	memcpy(job->chip_id,g_chip_id,sizeof(job->chip_id));
+	memcpy(job->flash_id,g_flash_id,sizeof(job->flash_id));
+	job->result=r;
+	libusb_close(handle);
+	devinfo.handle=NULL;
+
+	return NULL;
+}
+
+int cmp_identify(const void *a,const void *b)
+{
+	return strcmp(((IdentifyJob *)a)->port,((IdentifyJob *)b)->port);
+}
+
+// Identify every attached DLB4 concurrently and print one tab separated
+// line per board, ordered by USB port path.
+// The table goes to out, one board per line with plain '\n' endings
+int identify_all(FILE *out)
+{
+	libusb_device **list;
+	struct libusb_device_descriptor desc;
+	IdentifyJob *job;
+	pthread_t *tid;
+	SpiFlashPart *part;
+	EcChipInfo *chip;
+	ssize_t cnt;
+	int i,n=0,fail=0;
+
+	cnt=libusb_get_device_list(NULL,&list);
+	if(cnt<0)
+		ERR_EXIT(cnt);
+	job=calloc(cnt+1,sizeof(IdentifyJob));
+	tid=calloc(cnt+1,sizeof(pthread_t));
+
+	for(i=0;i<cnt;i++) {
+		if(libusb_get_device_descriptor(list[i],&desc)<0 || desc.idVendor!=VID || desc.idProduct!=PID)
+			continue;
+		job[n].dev=list[i];
+		job[n].flag=g_flag;
+		usb_port_path(list[i],job[n].port,sizeof(job[n].port));
+		if(pthread_create(&tid[n],NULL,identify_board,&job[n])==0)
+			n++;
+	}
+	for(i=0;i<n;i++)
+		pthread_join(tid[i],NULL);
+	libusb_free_device_list(list,1);
+
+	qsort(job,n,sizeof(IdentifyJob),cmp_identify);
+	fprintf(out,"#port\tfw\tchip\tflash\tpart\tstatus\n");
+	for(i=0;i<n;i++) {
+		chip=find_ec_chip(job[i].chip_id);
+		part=find_spi_part(job[i].flash_id);
+		fprintf(out,"%s\t%02x%02x\t",job[i].port,job[i].fw_ver[0],job[i].fw_ver[1]);
+		if(!(g_flag&ITE_USE_SPI) && job[i].result==0)
+			fprintf(out,"%x%02x%02x",job[i].chip_id[3],job[i].chip_id[4],job[i].chip_id[5]);
+		else
+			fprintf(out,"-");
+		fprintf(out,"\t%02x%02x%02x\t%s\t",job[i].flash_id[0],job[i].flash_id[1],job[i].flash_id[2],
+			(g_flag&ITE_USE_SPI)?(part?part->name:"-"):(chip?chip->name:"-"));
+		if(job[i].result==0) {
+			fprintf(out,"ok\n");
+		} else {
+			fprintf(out,"%s\n",(job[i].result<0)?libusb_error_name(job[i].result):"no chip");
+			fail++;
+		}
+	}
+	if(n==0)
+		fprintf(out,"# no ITE DLB4 board found\n");
+	fflush(out);
+
+	free(job);
+	free(tid);
+	return fail?1:0;
+}
+
+// Job list, one image per line ('#' starts a comment):
+//   <image file> [i2c|spi] [chip ID (I2C) or JEDEC ID (SPI), '*' for any]
+//   ec_a.bin     i2c       81302
+//   ec_b.bin     spi       c86514
+//   ec_c.bin
+int load_jobs(char *jobfile)
+{
+	FILE *fp;
+	FlashJob *job;
+	char line[512];
+	char path[256],iface[8],id[16];
+	int n=0,k;
+
+	printf("\n\rOpen job list: %s",jobfile);
+	if((fp=fopen(jobfile,"r"))==NULL) {
+		printf("\n\ropen job list error : %s",jobfile);
+		return ITE_ERR;
+	}
+
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		n++;
+		if(line[0]=='#')
+			continue;
+		k=sscanf(line,"%255s %7s %15s",path,iface,id);
+		if(k<1)
+			continue;
+		g_job=realloc(g_job,(g_job_no+1)*sizeof(FlashJob));
+		job=&g_job[g_job_no];
+		memset(job,0,sizeof(FlashJob));
+		job->image=strdup(path);
+		job->spi=(g_flag&ITE_USE_SPI)?1:0;
+		if(k>=2 && strcmp(iface,"spi")==0)
+			job->spi=1;
+		else if(k>=2 && strcmp(iface,"i2c")==0)
+			job->spi=0;
+		else if(k>=2) {
+			printf("\n\r%s:%d: interface must be i2c or spi",jobfile,n);
+			fclose(fp);
+			return ITE_ERR;
+		}
+		if(k>=3 && strcmp(id,"*"))
+			job->id=strtoul(id,NULL,16);
+		if((fi=fopen(job->image,"rb"))==NULL) {
+			printf("\n\r%s:%d: open file error : %s",jobfile,n,job->image);
+			fclose(fp);
+			return ITE_ERR;
+		}
+		fseek(fi,0,SEEK_END);
+		job->size=ftell(fi);
+		fclose(fi);
+		fi=NULL;
+		job->owner=-1;
+		job->board=-1;
+		if(job->id)
+			g_job_probe|=1<<job->spi;
+		g_job_no++;
+	}
+	fclose(fp);
+
+	if(g_job_no==0) {
+		printf("\n\r%s: no jobs listed",jobfile);
+		return ITE_ERR;
+	}
+	printf(" ( %d jobs )\n\r",g_job_no);
+	return 0;
+}
+
+int job_fits(BoardWorker *w,FlashJob *job)
+{
+	return job->id==0 || w->id[job->spi]==job->id;
+}
+
+// Read the board IDs the job list matches on, over each interface in use
+void *probe_worker(void *arg)
+{
+	BoardWorker *w=(BoardWorker *)arg;
+	int spi;
+
+	if(libusb_open(w->dev,&w->handle)!=LIBUSB_SUCCESS) {
+		w->handle=NULL;
+		return NULL;
+	}
+	devinfo.handle=w->handle;
+	devinfo.endpoint_in=0x81;
+	devinfo.endpoint_out=0x02;
+
+	for(spi=0;spi<2;spi++) {
+		if(!(g_job_probe&(1<<spi)))
+			continue;
+		g_flag=spi?ITE_USE_SPI:0;
+		set_interface();
+		if(probe_board())
+			continue;
+		if(spi)
+			w->id[spi]=(g_flash_id[0]<<16)|(g_flash_id[1]<<8)|g_flash_id[2];
+		else
+			w->id[spi]=(g_chip_id[3]<<16)|(g_chip_id[4]<<8)|g_chip_id[5];
+	}
+	devinfo.handle=NULL;
+
+	return NULL;
+}
+
+static pthread_mutex_t job_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond=PTHREAD_COND_INITIALIZER;
+
+// Next job for the board: the oldest one on its own queue, otherwise steal
+// the newest compatible job from the board with the most pending bytes.
+// Called with job_lock held.
+FlashJob *find_job(BoardWorker *w)
+{
+	FlashJob *job=NULL;
+	int i;
+
+	for(i=0;i<g_job_no;i++) {
+		if(g_job[i].state==ITE_JOB_PENDING && g_job[i].owner==w->idx) {
+			job=&g_job[i];
+			break;
+		}
+	}
+	if(job==NULL) {
+		for(i=g_job_no-1;i>=0;i--) {
+			if(g_job[i].state!=ITE_JOB_PENDING || !job_fits(w,&g_job[i]))
+				continue;
+			if(job==NULL || g_board[g_job[i].owner].queued>g_board[job->owner].queued)
+				job=&g_job[i];
+		}
+	}
+	return job;
+}
+
+// Claim a job for the board, waiting while its hub is at its limit.
+// Returns NULL once nothing is left that the board can run.
+FlashJob *take_job(BoardWorker *w)
+{
+	HubLink *hub=&g_hub[w->hub];
+	FlashJob *job;
+
+	pthread_mutex_lock(&job_lock);
+	while((job=find_job(w))!=NULL && hub->active>=hub->limit && !g_stop)
+		pthread_cond_wait(&job_cond,&job_lock);
+	if(g_stop)
+		job=NULL;
+	if(job!=NULL) {
+		if(job->owner!=w->idx)
+			w->stolen++;
+		g_board[job->owner].queued-=job->size;
+		job->state=ITE_JOB_RUNNING;
+		job->board=w->idx;
+		if(hub->active++==0)
+			hub->busy_t0=now_ms();
+		job->level=hub->active;
+	}
+	pthread_mutex_unlock(&job_lock);
+
+	return job;
+}
+
+// Fold a finished job into its hub's throughput per concurrency level.
+// While the hub runs at its limit and the aggregate MB/s still grows by
+// ITE_HUB_GAIN, one more job is let in; when it shrinks the limit backs
+// off for good. Called with job_lock held.
+void hub_job_done(HubLink *hub,FlashJob *job)
+{
+	double mbps;
+	int k=job->level;
+
+	hub->jobs++;
+	hub->bytes+=job->size;
+	if(--hub->active==0)
+		hub->busy_ms+=now_ms()-hub->busy_t0;
+	if(job->result || job->ms<=0 || k>ITE_HUB_LEVELS)
+		return;
+
+	mbps=job->size/job->ms/1000;
+	hub->rate[k-1]=(hub->rate[k-1]>0)?(hub->rate[k-1]+mbps)/2:mbps;
+	if(k!=hub->limit || hub->settled)
+		return;
+	if(k>1 && hub->rate[k-2]>0 && k*hub->rate[k-1]<(k-1)*hub->rate[k-2]*ITE_HUB_GAIN) {
+		hub->limit=k-1;
+		hub->settled=1;
+	} else if(hub->limit<hub->boards && hub->limit<ITE_HUB_LEVELS) {
+		hub->limit++;
+	}
+}
+
+int run_job(FlashJob *job)
+{
+	int r;
+
+	g_flag=(g_job_flag&~ITE_USE_SPI)|(job->spi?ITE_USE_SPI:0);
+	check_parameter();
+	g_image_name=job->image;
+	r=init_file(job->image);
+	if(r==0) {
+		audit_begin();
+		r=do_iteflash();
+		audit_log(r);
+	}
+	exit_file();
 
 	return r;
+}
 
-}	
-
-int enter_spi()
+void *board_worker(void *arg)
 {
+	BoardWorker *w=(BoardWorker *)arg;
+	FlashJob *job;
+	double t0;
+
+	devinfo.handle=w->handle;
+	devinfo.endpoint_in=0x81;
+	devinfo.endpoint_out=0x02;
+
+	while(!g_stop && (job=take_job(w))!=NULL) {
+		t0=now_ms();
+		job->result=run_job(job);
+		job->ms=now_ms()-t0;
+
+		pthread_mutex_lock(&job_lock);
+		job->state=ITE_JOB_DONE;
+		w->jobs++;
+		w->busy_ms+=job->ms;
+		if(job->result)
+			w->fails++;
+		hub_job_done(&g_hub[w->hub],job);
+		pthread_cond_broadcast(&job_cond);
+		pthread_mutex_unlock(&job_lock);
+		printf("\n\rJob %d %s on %s : %s ( %.1f s )\n\r",(int)(job-g_job)+1,job->image,w->port,
+			(job->result==0)?"PASS":"FAIL",job->ms/1000);
+	}
+	devinfo.handle=NULL;
 
-        int r;
+	return NULL;
+}
 
-        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_LOW);
-        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_OUTPUT);
-        msleep(100);
+// Upstream link of a board at port path "bus-p1.p2...pn": the hub at
+// "bus-p1...pn-1", or the root hub "bus" for boards on a root port.
+int find_hub(char *port)
+{
+	char path[32];
+	char *p;
+	int i;
+
+	strncpy(path,port,sizeof(path)-1);
+	path[sizeof(path)-1]=0;
+	p=strrchr(path,'.');
+	if(p==NULL)
+		p=strchr(path,'-');
+	if(p!=NULL)
+		*p=0;
+	for(i=0;i<g_hub_no;i++) {
+		if(strcmp(g_hub[i].path,path)==0)
+			return i;
+	}
+	strcpy(g_hub[i].path,path);
+	g_hub[i].limit=1;
+	g_hub_no++;
+	return i;
+}
 
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_LOW);
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_OUTPUT);
-        msleep(100);
+// Run the job list across every attached DLB4. Each job is queued on the
+// compatible board with the least pending work; a board that runs out of
+// its own jobs steals from the busiest compatible queue. Boards behind one
+// hub only run as many jobs at once as their shared link scales to.
+int job_scheduler()
+{
+	libusb_device **list;
+	struct libusb_device_descriptor desc;
+	pthread_t *tid;
+	BoardWorker *w;
+	ssize_t cnt;
+	double t0,wall;
+	char id[2][16];
+	int i,b,pass=0,fail=0,orphan=0;
+
+	cnt=libusb_get_device_list(NULL,&list);
+	if(cnt<0)
+		ERR_EXIT(cnt);
+	g_board=calloc(cnt+1,sizeof(BoardWorker));
+	g_hub=calloc(cnt+1,sizeof(HubLink));
+	tid=calloc(cnt+1,sizeof(pthread_t));
+	g_job_flag=g_flag;
+
+	for(i=0;i<cnt;i++) {
+		if(libusb_get_device_descriptor(list[i],&desc)<0 || desc.idVendor!=VID || desc.idProduct!=PID)
+			continue;
+		w=&g_board[g_board_no];
+		w->dev=list[i];
+		w->idx=g_board_no;
+		w->speed=libusb_get_device_speed(list[i]);
+		usb_port_path(list[i],w->port,sizeof(w->port));
+		w->hub=find_hub(w->port);
+		if(pthread_create(&tid[g_board_no],NULL,probe_worker,w)==0) {
+			g_hub[w->hub].boards++;
+			g_board_no++;
+		}
+	}
+	for(b=0;b<g_board_no;b++)
+		pthread_join(tid[b],NULL);
+	printf("\n\rBoards           : %d on %d hubs",g_board_no,g_hub_no);
+	for(b=0;b<g_board_no;b++)
+		printf("\n\r  %-14s : %s speed, hub %s",g_board[b].port,usb_speed_name(g_board[b].speed),
+			g_hub[g_board[b].hub].path);
+
+	for(i=0;i<g_job_no;i++) {
+		for(b=0;b<g_board_no;b++) {
+			w=&g_board[b];
+			if(w->handle==NULL || !job_fits(w,&g_job[i]))
+				continue;
+			if(g_job[i].owner<0 || w->queued<g_board[g_job[i].owner].queued)
+				g_job[i].owner=b;
+		}
+		if(g_job[i].owner<0) {
+			printf("\n\rJob %d %s : no board",i+1,g_job[i].image);
+			if(g_job[i].id)
+				printf(" with %s ID %x",g_job[i].spi?"JEDEC":"chip",g_job[i].id);
+			g_job[i].state=ITE_JOB_NO_BOARD;
+			continue;
+		}
+		g_board[g_job[i].owner].queued+=g_job[i].size;
+	}
+	printf("\n\r");
 
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_HIGH);
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_ALT);
-        msleep(100);
+	signal(SIGINT,stop_request);
+	signal(SIGTERM,stop_request);
+	t0=now_ms();
+	for(b=0;b<g_board_no;b++) {
+		if(g_board[b].handle!=NULL)
+			pthread_create(&tid[b],NULL,board_worker,&g_board[b]);
+	}
+	for(b=0;b<g_board_no;b++) {
+		if(g_board[b].handle==NULL)
+			continue;
+		pthread_join(tid[b],NULL);
+		libusb_close(g_board[b].handle);
+	}
+	wall=now_ms()-t0;
+	libusb_free_device_list(list,1);
+
+	printf("\n\r%-14s %-6s %-8s %-8s %5s %6s %5s %8s %6s\n\r","port","speed","chip","jedec","jobs","stolen","fail","busy s","util");
+	for(b=0;b<g_board_no;b++) {
+		w=&g_board[b];
+		for(i=0;i<2;i++) {
+			if(w->id[i])
+				snprintf(id[i],sizeof(id[i]),"%x",w->id[i]);
+			else
+				strcpy(id[i],"-");
+		}
+		printf("%-14s %-6s %-8s %-8s %5d %6d %5d %8.1f %5.0f%%\n\r",w->port,usb_speed_name(w->speed),id[0],id[1],
+			w->jobs,w->stolen,w->fails,w->busy_ms/1000,(wall>0)?w->busy_ms*100/wall:0);
+	}
+	for(i=0;i<g_job_no;i++) {
+		if(g_job[i].state==ITE_JOB_DONE && g_job[i].result==0)
+			pass++;
+		else if(g_job[i].state==ITE_JOB_DONE)
+			fail++;
+		else
+			orphan++;
+	}
+	printf("\n\r%-14s %6s %5s %5s %8s %8s %7s\n\r","hub","boards","limit","jobs","MB","busy s","MB/s");
+	for(b=0;b<g_hub_no;b++) {
+		printf("%-14s %6d %5d %5d %8.1f %8.1f %7.2f\n\r",g_hub[b].path,g_hub[b].boards,g_hub[b].limit,
+			g_hub[b].jobs,g_hub[b].bytes/1e6,g_hub[b].busy_ms/1000,
+			(g_hub[b].busy_ms>0)?g_hub[b].bytes/g_hub[b].busy_ms/1000:0);
+	}
+	printf("Jobs: %d passed, %d failed, %d not run ( %.1f s )\n\r",pass,fail,orphan,wall/1000);
 
-        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_HIGH);
-        Dlb4SetGPIO(ITE_DLB_GPIO_G6,ITE_DLB_GPIO_ALT);
-        return r;
+	free(tid);
+	free(g_hub);
+	g_hub=NULL;
+	g_hub_no=0;
+	return (pass==g_job_no)?0:1;
+}
 
-}	
 
-int reset_ec()
+int init_usb()
 {
 	int r;
+        const struct libusb_version* version;
 
-	CALL_CHECK(WriteReg(0x20,0x06,0x44));
-	CALL_CHECK(RunCtrl(0x80,0,0));
-
-	Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_LOW);
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_OUTPUT);
-        //msleep(100);
-        sleep(1);
-        Dlb4SetGPIO(ITE_DLB_GPIO_C1,ITE_DLB_GPIO_HIGH);
+        VID = 0x048D;
+        PID = 0x8390;
+        version = libusb_get_version();
+        printf("Using libusb v%d.%d.%d.%d\n", version->major, version->minor, version->micro, version->nano);
+        r = libusb_init(NULL);
 
 	return r;
 }	
 
-void show_itedlb4()
+int add_region(char *filename,uint32_t offset)
 {
-        printf("\n\n\rITE DLB4 FW Version : %02x%02x",g_fw_ver[0],g_fw_ver[1]);
-        printf("\n\r===================================");
-	if(!(g_flag&ITE_USE_SPI)) {
-        	printf("\n\rCHIP ID          : %x%02x%02x",g_chip_id[0],g_chip_id[1],g_chip_id[2]);
-        	printf(" ( %x%02x%02x ) ",g_chip_id[3],g_chip_id[4],g_chip_id[5]);
-	}
-        printf("\n\rFlash ID         : %02x %02x %02x\n\r",g_flash_id[0],g_flash_id[1],g_flash_id[2]);
-}	
+	int i;
+	long file_size;
 
-int do_iteflash()
-{
-	int r=0;
-	int loop=0;
-	
-	g_chip_id[0]=0x00;
-	printf("\n\rConnecting ITE Device....");
-	
-	if((g_flag&ITE_USE_SPI)) {
-	        printf("\n\rFlash via SPI interface...");
-		init_dlb4_spi();
-	} else {
-		do {
-			CALL_CHECK(init_dlb4());
-			if(g_chip_id[0]!=0x00) {
-				break;
-			}
-			printf(".");
-                	fflush(stdout);
-		}while(loop++ < 2000);
+	if(g_region_no>=ITE_REGIONS_MAX) {
+		printf("\n\rtoo many images, only %d allowed",ITE_REGIONS_MAX);
+		return ITE_ERR;
+	}
 
-        	if(g_chip_id[0]==0) {
-                	printf("\n\rGet Chip ERR! Please re-run the program");
-                	return -1;
-        	}
+	printf("\n\rOpen file: %s",filename);
+	if(offset)
+		printf(" @ 0x%x",offset);
+	printf("\n\r");
+        if ( (fi=fopen(filename,"rb"))==NULL) {
+                printf("open file error : %s \n",filename);
+		return ITE_ERR;
+	}
+        fseek(fi,0,SEEK_END);
+        file_size = ftell(fi);
+	fclose(fi);
+	fi=NULL;
 
+	for(i=0;i<g_region_no;i++) {
+		if(offset<g_region[i].offset+g_region[i].size && g_region[i].offset<offset+file_size) {
+			printf("\n\r%s overlaps %s",filename,g_region[i].filename);
+			return ITE_ERR;
+		}
 	}
 
+	g_region[g_region_no].filename=filename;
+	g_region[g_region_no].offset=offset;
+	g_region[g_region_no].size=file_size;
+	g_region_no++;
 
-	show_itedlb4();	
+	return 0;
+}
 
-	CALL_CHECK(eraseall());
-	if(!(g_flag&ITE_SKIP_CHECK))
-		CALL_CHECK(checkall());
-	CALL_CHECK(programall());
-	if(!(g_flag&ITE_SKIP_VERIFY))
-		CALL_CHECK(verifyall());
+// Read every region into one flash-layout buffer, gaps left as 0xFF.
+int load_regions()
+{
+	int i;
+	int len;
+	int file_size=0;
+	ImageRegion *rg;
 
-	//Enable QE Bit After flash
-	CALL_CHECK(WriteNonSSTFlashStatus(0x82,0,0x2));
+	for(i=0;i<g_region_no;i++) {
+		if(g_region[i].offset+g_region[i].size>file_size)
+			file_size=g_region[i].offset+g_region[i].size;
+	}
+	g_file_size = file_size;
 
-	reset_ec();
+	//printf("\n\rfile size = %d\n\r",file_size);
+	g_blk_no= file_size / g_blk_size;
+	if(file_size%g_blk_size)
+		g_blk_no++;
 
-	return r;
+       	g_flash_size=g_blk_size*g_blk_no;
+	//printf("\n\rg_blk_no = %d g_flash_size=%d\n\r",g_blk_no,g_flash_size);
 
-}	
+        g_writebuf = malloc(g_flash_size);
+	if(g_writebuf==NULL) {
+		printf("\n\ralloc g_writebuf fail");
+		return ITE_ERR;
+	}	
+        g_readbuf = malloc(g_flash_size);
+	if(g_readbuf==NULL) {
+		printf("\n\ralloc g_readbuf fail");
+		return ITE_ERR;
+	}	
 
+	//pad gaps and the last block with erased bytes so they program as a no-op
+	memset(g_writebuf,0xFF,g_flash_size);
+	for(i=0;i<g_region_no;i++) {
+		rg=&g_region[i];
+	        if ( (fi=fopen(rg->filename,"rb"))==NULL) {
+	                printf("open file error : %s \n",rg->filename);
+			return ITE_ERR;
+		}
+                len = fread(g_writebuf+rg->offset,1,rg->size,fi);
+		fclose(fi);
+		fi=NULL;
+		if(len!=rg->size) {
+			printf("read file error : %s \n",rg->filename);
+			return ITE_ERR;
+		}
+	}
 
+	return 0;
+}
 
-int ite_device(uint16_t vid, uint16_t pid)
+void free_index()
 {
-	libusb_device_handle *handle;
-	libusb_device *dev;
-	int i, j, k, r=0;
-	uint8_t endpoint_in = 0, endpoint_out = 0;	// default IN and OUT endpoints
+	free(g_index.blank);
+	memset(&g_index,0,sizeof(g_index));
+}
 
-	ITE_DBG("\n\rOpening device...\n");
-	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+// Validity key of an indexed image file: size, inode and mtime in ns.
+// Checking it costs a stat(), unlike hashing the image again.
+int image_key(char *filename,unsigned long long *ino,long long *sec,long *nsec)
+{
+	struct stat st;
 
-	if (handle == NULL) {
-		perr("  Failed.\n");
+	if(stat(filename,&st))
 		return -1;
-	}
+	*ino=st.st_ino;
+	*sec=st.st_mtim.tv_sec;
+	*nsec=st.st_mtim.tv_nsec;
+	return 0;
+}
 
-	endpoint_in = 0x81;
-	endpoint_out = 0x02;
-	devinfo.handle = handle;
-	devinfo.endpoint_in = endpoint_in;
-	devinfo.endpoint_out = endpoint_out;
-	//CALL_CHECK(do_iteflash());
-	r=do_iteflash();
-	ITE_DBG("Closing device...\n");
-	libusb_close(handle);
+// Pick up <image>.idx when it was written for this very file: same size,
+// inode and mtime. A copied image or a rewritten one gets a new key, so
+// its index is ignored and the image scanned as before.
+void load_index(char *filename)
+{
+	FILE *fp;
+	char path[512],line[256],tag[16];
+	unsigned int offset;
+	unsigned long long h,ino,idx_ino;
+	long long sec,idx_sec;
+	long nsec,idx_nsec;
+	int size,ss,flash,s,n=0,blank=0;
+	unsigned long long hash;
+
+	snprintf(path,sizeof(path),"%s.idx",filename);
+	if((fp=fopen(path,"r"))==NULL)
+		return;
+	if(fgets(line,sizeof(line),fp)==NULL ||
+	   sscanf(line,"# ite index size %d sector %d flash %d hash %llx ino %llu mtime %lld.%ld",
+		&size,&ss,&flash,&hash,&idx_ino,&idx_sec,&idx_nsec)!=7 ||
+	   size!=g_file_size || ss<=0 || ss%256 || image_key(filename,&ino,&sec,&nsec) ||
+	   ino!=idx_ino || sec!=idx_sec || nsec!=idx_nsec) {
+		printf("\n\r%s: stale or not an index, ignored ( re-run 'ite index' )",path);
+		fclose(fp);
+		return;
+	}
 
-	return r;
-}	
+	free_index();
+	g_index.sect_no=(size+ss-1)/ss;
+	g_index.blank=calloc(g_index.sect_no,1);
+	if(g_index.blank==NULL) {
+		fclose(fp);
+		return;
+	}
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		tag[0]=0;
+		if(line[0]=='#' || sscanf(line,"%i %llx %15s",&offset,&h,tag)<2)
+			continue;
+		s=offset/ss;
+		if(offset%ss || s>=g_index.sect_no)
+			break;
+		n++;
+		if(strcmp(tag,"blank")==0) {
+			g_index.blank[s]=1;
+			blank++;
+		}
+	}
+	fclose(fp);
 
+	if(n!=g_index.sect_no) {
+		printf("\n\r%s: does not list every sector of %s, ignored",path,filename);
+		free_index();
+		return;
+	}
+	g_index.buf=g_writebuf;
+	g_index.size=size;
+	g_index.sector_size=ss;
+	g_index.flash_size=flash;
+	g_index.hash=hash;
+	printf("\n\rImage index: %s ( %d sectors, %d blank )",path,g_index.sect_no,blank);
+}
 
-int init_usb()
+int init_file(char* filename)
 {
 	int r;
-        const struct libusb_version* version;
-
-        VID = 0x048D;
-        PID = 0x8390;
-        version = libusb_get_version();
-        printf("Using libusb v%d.%d.%d.%d\n", version->major, version->minor, version->micro, version->nano);
-        r = libusb_init(NULL);
 
+	r=add_region(filename,0);
+	if(r)
+		return r;
+	r=load_regions();
+	if(r==0)
+		load_index(filename);
 	return r;
 }	
 
-int init_file(char* filename)
+// 'ite index image.bin': write image.bin.idx for the station to plan from.
+// With -t the sector and flash size of that EC chip or SPI part (JEDEC ID)
+// are used and an image that does not fit is rejected here rather than on
+// the line.
+int index_image(char *filename)
 {
-	int r=0;
-	int len;
-	int file_size;
-
-	printf("\n\rOpen file: %s\n\r",filename);
-        if ( (fi=fopen(filename,"rb"))!=NULL) {
-
-                fseek(fi,0,SEEK_END);
-                file_size = ftell(fi);
-                fseek(fi,0,SEEK_SET);
-		//printf("\n\rfile size = %d\n\r",file_size);
-		g_blk_no= file_size / g_blk_size;
-		if(file_size%g_blk_size)
-			g_blk_no++;
+	FILE *fp;
+	char path[512];
+	uint8_t id[6]={0};
+	EcChipInfo *chip;
+	SpiFlashPart *part;
+	unsigned long long ino;
+	long long sec;
+	long nsec;
+	int ss=ITE_INDEX_SECTOR,flash=0;
+	int s,l,n,blank=0;
+
+	if(g_dry_target) {
+		id[0]=id[3]=g_dry_target>>16;
+		id[1]=id[4]=g_dry_target>>8;
+		id[2]=id[5]=g_dry_target;
+		chip=find_ec_chip(id);
+		part=find_spi_part(id);
+		if(chip!=NULL) {
+			ss=chip->sector_size;
+			flash=chip->flash_size;
+		} else if(part!=NULL) {
+			ss=part->sector_size;
+			flash=part->size;
+		} else if(id[2]>=0x10 && id[2]<=0x19) {
+			//unlisted SPI part, JEDEC capacity byte is log2 of the size
+			flash=1<<id[2];
+		} else {
+			printf("\n\rUnknown chip or flash part %x\n\r",g_dry_target);
+			return 1;
+		}
+	}
+	if(init_file(filename) || image_key(filename,&ino,&sec,&nsec))
+		return 1;
+	if(flash && g_file_size>flash) {
+		printf("\n\rImage size %d exceeds flash size %d\n\r",g_file_size,flash);
+		exit_file();
+		return 1;
+	}
 
-        	g_flash_size=g_blk_size*g_blk_no;
-		//printf("\n\rg_blk_no = %d g_flash_size=%d\n\r",g_blk_no,g_flash_size);
+	snprintf(path,sizeof(path),"%s.idx",filename);
+	if((fp=fopen(path,"w"))==NULL) {
+		printf("\n\ropen index error : %s\n\r",path);
+		exit_file();
+		return 1;
+	}
+	fprintf(fp,"# ite index size %d sector %d flash %d hash %016llx ino %llu mtime %lld.%09ld\n",g_file_size,ss,flash,
+		(unsigned long long)ite_hash(g_writebuf,g_file_size,ITE_HASH_INIT),ino,sec,nsec);
+	n=(g_file_size+ss-1)/ss;
+	for(s=0;s<n;s++) {
+		//the last sector is hashed as padded with 0xFF, as it is flashed
+		for(l=s*ss;l<(s+1)*ss && g_writebuf[l]==0xFF;l++)
+			;
+		if(l==(s+1)*ss)
+			blank++;
+		fprintf(fp,"0x%06x %016llx%s\n",s*ss,(unsigned long long)ite_hash(g_writebuf+s*ss,ss,ITE_HASH_INIT),
+			(l==(s+1)*ss)?" blank":"");
+	}
+	fclose(fp);
+	printf("\n\r%s: %d sectors of %d bytes, %d blank\n\r",path,n,ss,blank);
+	exit_file();
+	return 0;
+}
 
+// Manifest format, one image per line ('#' starts a comment):
+//   <flash offset> <image file>
+//   0x00000       ec_ro.bin
+//   0x40000       ec_rw.bin
+int init_manifest(char* manifest)
+{
+	FILE *fp;
+	char line[512];
+	char path[256];
+	unsigned int offset;
+	int n=0,r;
+
+	printf("\n\rOpen manifest: %s",manifest);
+	if((fp=fopen(manifest,"r"))==NULL) {
+		printf("\n\ropen manifest error : %s",manifest);
+		return ITE_ERR;
+	}
 
+	while(fgets(line,sizeof(line),fp)!=NULL) {
+		n++;
+		if(line[0]=='#' || line[0]=='\n' || line[0]=='\r')
+			continue;
+		if(sscanf(line,"%i %255s",&offset,path)!=2) {
+			printf("\n\r%s:%d: bad manifest entry",manifest,n);
+			fclose(fp);
+			return ITE_ERR;
+		}
+		r=add_region(strdup(path),offset);
+		if(r) {
+			fclose(fp);
+			return r;
+		}
+	}
+	fclose(fp);
 
-                g_writebuf = malloc(g_flash_size);
-		if(g_writebuf==NULL) {
-			printf("\n\ralloc g_writebuf fail");
-		}	
-                g_readbuf = malloc(g_flash_size);
-		if(g_readbuf==NULL) {
-			printf("\n\ralloc g_readbuf fail");
-		}	
-                len = fread(g_writebuf,1,g_flash_size,fi);
-        } else {
-                printf("open file error : %s \n",filename);
-		r=ITE_ERR;
-        }
+	if(g_region_no==0) {
+		printf("\n\r%s: no images listed",manifest);
+		return ITE_ERR;
+	}
 
-	return r;
-}	
+	return load_regions();
+}
 
 
 void exit_file()
 {
 	free(g_writebuf);
 	free(g_readbuf);
-	fclose(fi);
+	free(g_sect_map);
+	g_writebuf=NULL;
+	g_readbuf=NULL;
+	g_sect_map=NULL;
+	g_region_no=0;
+	free_index();
 }	
 
 void show_time()
@@ -886,14 +3792,10 @@ void show_time()
          (void) printf("Current time is %s", c_time_string);
 }	
 
-void check_parameter()
+// Command set and default flash modes for the interface in g_flag
+void set_interface()
 {
-        g_blk_size=65536;
-        g_blk_no=16;
-        g_flash_size=g_blk_size*g_blk_no;
-
         if((g_flag&ITE_USE_SPI)) {
-                printf("\n\rFlash via SPI interface...");
                 ITE_CONNECT_MODE        = ITE_CONNECT_MODE_NODBGR;
                 ITE_OP_CODE             = ITE_OP_CODE_DBGR_X;
                 ITE_FUN_CODE_FLASHID    = ITE_FUN_CODE_FLASHID_READ_SPI;
@@ -901,7 +3803,7 @@ void check_parameter()
 		ITE_FUN_CODE_ERASE	= ITE_FUN_CODE_FLASH_ERASE_SPI;
 		ITE_FUN_CODE_WRITE	= ITE_FUN_CODE_FLASH_WRITE_SPI;
 
-		Flash.read_mode = 3;
+		Flash.read_mode = ITE_READ_MODE;
         	Flash.erase_type = ITE_ERASE_TYPE_3_UNPROTECT_E;
         	Flash.erase_mode = ITE_ERASE_MODE_0_CHIP_ERASE ;
                 Flash.write_type = 0; //ITE_PROGRAM_TYPE
@@ -909,7 +3811,6 @@ void check_parameter()
 
 
         } else {
-                printf("\n\rFlash via I2C interface...");
                 ITE_CONNECT_MODE        = ITE_CONNECT_MODE_DBGR;
                 ITE_OP_CODE             = ITE_OP_CODE_DBGR_O;
                 ITE_FUN_CODE_FLASHID    = ITE_FUN_CODE_FLASHID_READ;
@@ -927,8 +3828,151 @@ void check_parameter()
 
 
 
+}
+
+void check_parameter()
+{
+        g_blk_size=65536;
+        g_blk_no=16;
+        g_flash_size=g_blk_size*g_blk_no;
+
+        if((g_flag&ITE_USE_SPI))
+                printf("\n\rFlash via SPI interface...");
+        else
+                printf("\n\rFlash via I2C interface...");
+	set_interface();
 }	
 
+// --wait special=ms,spi=ms,reset=ms
+int parse_wait(char *arg)
+{
+	char *tok;
+	unsigned int ms;
+	char name[16];
+
+	for(tok=strtok(arg,",");tok!=NULL;tok=strtok(NULL,",")) {
+		if(sscanf(tok,"%15[a-z]=%u",name,&ms)!=2) {
+			printf("\n\rbad --wait entry : %s\n\r",tok);
+			return ITE_ERR;
+		}
+		if(strcmp(name,"special")==0)
+			g_wait.special=ms;
+		else if(strcmp(name,"spi")==0)
+			g_wait.spi=ms;
+		else if(strcmp(name,"reset")==0)
+			g_wait.reset=ms;
+		else {
+			printf("\n\runknown --wait name : %s\n\r",name);
+			return ITE_ERR;
+		}
+	}
+	return 0;
+}
+
+// --patch offset:file or offset:hex bytes, e.g. 0xff000:serial.bin or
+// 0xff010:0123abcd. A value naming an existing file is read as the file.
+int parse_patch(char *arg)
+{
+	FlashPatch *p;
+	FILE *fp;
+	char *val,*end;
+	long size;
+	int i;
+
+	if(g_patch_no>=ITE_PATCH_MAX) {
+		printf("\n\rtoo many patches, only %d allowed\n\r",ITE_PATCH_MAX);
+		return ITE_ERR;
+	}
+	p=&g_patch[g_patch_no];
+	val=strchr(arg,':');
+	if(val!=NULL)
+		p->offset=strtoul(arg,&end,0);
+	if(val==NULL || end!=val) {
+		printf("\n\rbad --patch, use offset:file or offset:hex : %s\n\r",arg);
+		return ITE_ERR;
+	}
+	val++;
+
+	if((fp=fopen(val,"rb"))!=NULL) {
+		fseek(fp,0,SEEK_END);
+		size=ftell(fp);
+		fseek(fp,0,SEEK_SET);
+		p->data=malloc(size>0?size:1);
+		if(fread(p->data,1,size,fp)!=size) {
+			printf("\n\rread file error : %s\n\r",val);
+			fclose(fp);
+			return ITE_ERR;
+		}
+		fclose(fp);
+	} else {
+		size=strlen(val);
+		if(size%2 || strspn(val,"0123456789abcdefABCDEF")!=size) {
+			printf("\n\r--patch value is neither a file nor hex bytes : %s\n\r",val);
+			return ITE_ERR;
+		}
+		size/=2;
+		p->data=malloc(size>0?size:1);
+		for(i=0;i<size;i++)
+			sscanf(val+i*2,"%2hhx",&p->data[i]);
+	}
+	if(size==0) {
+		printf("\n\rempty --patch : %s\n\r",arg);
+		return ITE_ERR;
+	}
+	p->size=size;
+	g_patch_no++;
+
+	return 0;
+}
+
+// --peek addr:len or --poke addr:hex bytes, EC register addresses
+int parse_reg(char *arg,int write)
+{
+	RegAccess *ra;
+	char *val,*end;
+	unsigned long addr,len;
+	int i;
+
+	if(g_reg_no>=ITE_REG_ACCESS_MAX) {
+		printf("\n\rtoo many --peek/--poke, only %d allowed\n\r",ITE_REG_ACCESS_MAX);
+		return ITE_ERR;
+	}
+	ra=&g_reg[g_reg_no];
+	val=strchr(arg,':');
+	addr=(val!=NULL)?strtoul(arg,&end,0):0;
+	if(val==NULL || end!=val || addr>0xffff) {
+		printf("\n\rbad %s : %s\n\r",write?"--poke, use addr:hex":"--peek, use addr:len",arg);
+		return ITE_ERR;
+	}
+	val++;
+	if(write) {
+		len=strlen(val);
+		if(len==0 || len%2 || strspn(val,"0123456789abcdefABCDEF")!=len) {
+			printf("\n\r--poke value is not hex bytes : %s\n\r",val);
+			return ITE_ERR;
+		}
+		len/=2;
+		ra->data=malloc(len);
+		for(i=0;i<len;i++)
+			sscanf(val+i*2,"%2hhx",&ra->data[i]);
+	} else {
+		len=strtoul(val,&end,0);
+		if(*end || len==0) {
+			printf("\n\rbad --peek length : %s\n\r",val);
+			return ITE_ERR;
+		}
+	}
+	if(addr+len>0x10000) {
+		printf("\n\r%s 0x%lx+0x%lx runs past 0xffff\n\r",write?"--poke":"--peek",addr,len);
+		return ITE_ERR;
+	}
+	ra->addr=addr;
+	ra->len=len;
+	g_reg_no++;
+
+	return 0;
+}
+
 int main(int argc, char** argv)
 {
 	int r=0;
@@ -936,7 +3980,10 @@ int main(int argc, char** argv)
 	int c;
 	char *filename=NULL;
 	//char *optstring = "f:s:";
-	char *optstring = "f:s:u";
+	char *optstring = "f:s:up:m:rSwl:q:o:L:nt:iW:J:P:VH:O:x:X:R::E:";
+	char *manifest=NULL;
+	char *jobs=NULL;
+	FILE *table=NULL;
 	char *skip=NULL;
 	char skip_check[]="check";
 	char skip_verify[]="verify";
@@ -944,6 +3991,28 @@ int main(int argc, char** argv)
         	{ "filename",       required_argument,      NULL, 'f' },
         	{ "skip",           required_argument,      NULL, 's' },
         	{ "usespi",        no_argument,      NULL, 'u' },
+        	{ "parts",          required_argument,      NULL, 'p' },
+        	{ "manifest",       required_argument,      NULL, 'm' },
+        	{ "repair",         no_argument,      NULL, 'r' },
+        	{ "station",        no_argument,      NULL, 'S' },
+        	{ "watch",          no_argument,      NULL, 'w' },
+        	{ "log",            required_argument,      NULL, 'l' },
+        	{ "query",          required_argument,      NULL, 'q' },
+        	{ "offset",         required_argument,      NULL, 'o' },
+        	{ "length",         required_argument,      NULL, 'L' },
+        	{ "dry-run",        no_argument,      NULL, 'n' },
+        	{ "target",         required_argument,      NULL, 't' },
+        	{ "identify",       no_argument,      NULL, 'i' },
+        	{ "wait",           required_argument,      NULL, 'W' },
+        	{ "jobs",           required_argument,      NULL, 'J' },
+        	{ "patch",          required_argument,      NULL, 'P' },
+        	{ "verify-only",    no_argument,      NULL, 'V' },
+        	{ "hash-ref",       required_argument,      NULL, 'H' },
+        	{ "hash-out",       required_argument,      NULL, 'O' },
+        	{ "peek",           required_argument,      NULL, 'x' },
+        	{ "poke",           required_argument,      NULL, 'X' },
+        	{ "low-jitter",     optional_argument,      NULL, 'R' },
+        	{ "external",       required_argument,      NULL, 'E' },
         	{ 0, 0, 0, 0}
     	};
 
@@ -956,6 +4025,36 @@ int main(int argc, char** argv)
         	switch (c) {
 			//use -f to skip check stage
 			case 'f': filename=optarg; 		break;
+			case 'm': manifest=optarg; 		break;
+			case 'E': g_ext_image=optarg; 		break;
+			case 'J': jobs=optarg; 			break;
+			case 'r': g_flag |= ITE_REPAIR; 	break;
+			case 'S': g_flag |= ITE_STATION; 	break;
+			case 'w': g_flag |= ITE_WATCH; 	break;
+			case 'l': g_audit_file=optarg; 	break;
+			case 'q': return audit_summary(optarg);
+			case 'o': g_win_offset=strtoul(optarg,NULL,0); break;
+			case 'L': g_win_length=strtoul(optarg,NULL,0); break;
+			case 'n': g_flag |= ITE_DRY_RUN; 	break;
+			case 't': g_dry_target=strtoul(optarg,NULL,16); break;
+			case 'i': g_flag |= ITE_IDENTIFY; 	break;
+			case 'V': g_flag |= ITE_VERIFY_ONLY; 	break;
+			case 'R': g_flag |= ITE_LOW_JITTER;
+				  if(optarg)
+					g_rt_cpu=atoi(optarg);
+				  break;
+			case 'H': g_hash_ref=optarg; 		break;
+			case 'O': g_hash_out=optarg; 		break;
+			case 'x':
+			case 'X': if(parse_reg(optarg,c=='X'))
+					exit(1);
+				  break;
+			case 'P': if(parse_patch(optarg))
+					exit(1);
+				  break;
+			case 'W': if(parse_wait(optarg))
+					exit(1);
+				  break;
             		case 's': skip = optarg; 
 				  if(strcmp(skip,skip_check)==0)
 					g_flag |= ITE_SKIP_CHECK;
@@ -966,39 +4065,155 @@ int main(int argc, char** argv)
                         case 'u': 
 				  g_flag |= ITE_USE_SPI;
                                   break;
+                        case 'p': 
+				  if(load_spi_parts(optarg))
+					exit(1);
+                                  break;
             		default:
                 		printf("Usage: %s [...]\n", argv[0]);
                 		exit(1);
         	}
     	}
 
+	if((g_flag&ITE_IDENTIFY)) {
+		//stdout carries only the table, the banner and board chatter go to stderr
+		fflush(stdout);
+		table=fdopen(dup(STDOUT_FILENO),"w");
+		if(table==NULL || dup2(STDERR_FILENO,STDOUT_FILENO)<0) {
+			printf("\n\rcan't set up the table output\n\r");
+			return 1;
+		}
+	}
+
 	check_parameter();
 
 	printf("\n\rITE DLB4 Linux Flash Tool: Version %s\n\r",VERSION);
 	show_time();
-	if(filename == NULL) {
+	if(optind<argc && strcmp(argv[optind],"index")==0) {
+		if(optind+1>=argc) {
+			printf("\n\rUsage: %s index image.bin [...] [-t chip]\n\r",argv[0]);
+			return 1;
+		}
+		for(c=optind+1;c<argc && r==0;c++)
+			r=index_image(argv[c]);
+		return r;
+	}
+	if((g_flag&ITE_IDENTIFY)) {
+		r=init_usb();
+		if (r < 0)
+	                return r;
+		r=identify_all(table);
+		fclose(table);
+	        libusb_exit(NULL);
+		return r;
+	}
+
+	if(jobs != NULL) {
+		if(filename != NULL || manifest != NULL || g_win_offset || g_win_length || g_patch_no || g_reg_no ||
+		   g_ext_image != NULL ||
+		   (g_flag&(ITE_STATION|ITE_WATCH|ITE_DRY_RUN))) {
+			printf("\n\r--jobs takes its images from the job list only\n\r");
+			return 1;
+		}
+		if(load_jobs(jobs))
+			return 1;
+		r=init_usb();
+		if (r < 0)
+	                return r;
+		if((g_flag&ITE_LOW_JITTER) && lowjit_start())
+			g_flag&=~ITE_LOW_JITTER;
+		r=job_scheduler();
+		lowjit_stop();
+	        libusb_exit(NULL);
+		show_time();
+		return r;
+	}
+
+	if((g_hash_ref != NULL || g_hash_out != NULL) && !(g_flag&ITE_VERIFY_ONLY)) {
+		printf("\n\r--hash-ref/--hash-out need --verify-only\n\r");
+		return 1;
+	}
+	if((g_flag&ITE_VERIFY_ONLY) && (g_patch_no || (g_flag&ITE_WATCH) ||
+	   (g_hash_ref != NULL && (filename != NULL || manifest != NULL)))) {
+		printf("\n\r--verify-only compares with one image or one hash manifest and writes nothing\n\r");
+		return 1;
+	}
+
+	if(g_ext_image != NULL && ((g_flag&(ITE_USE_SPI|ITE_VERIFY_ONLY|ITE_WATCH)) || g_reg_no ||
+	   (filename == NULL && manifest == NULL) || access(g_ext_image,R_OK))) {
+		printf("\n\r--external takes a readable image and goes with an internal image (-f/-m) over I2C\n\r");
+		return 1;
+	}
+	if(g_reg_no && (filename != NULL || manifest != NULL || g_patch_no ||
+	   (g_flag&(ITE_VERIFY_ONLY|ITE_WATCH|ITE_STATION)))) {
+		printf("\n\r--peek/--poke run on their own, without an image\n\r");
+		return 1;
+	}
+
+	if(filename == NULL && manifest == NULL && g_patch_no == 0 && g_reg_no == 0 && !(g_flag&ITE_VERIFY_ONLY)) {
 		printf("\n\rchoose a file to flash..\n\r");
 		return 0;
 	}	
 
-	r=init_file(filename);
+	if(manifest != NULL && (g_win_offset || g_win_length)) {
+		printf("\n\r--offset/--length apply to a single image file\n\r");
+		return 1;
+	}
+	if((g_flag&ITE_WATCH) && (g_win_offset || g_win_length)) {
+		printf("\n\r--watch flashes every changed sector, it can't be combined with --offset/--length\n\r");
+		return 1;
+	}
+	if((g_flag&ITE_STATION) && (g_flag&ITE_WATCH)) {
+		printf("\n\r--station and --watch can't be combined\n\r");
+		return 1;
+	}
+	if(manifest != NULL && (g_flag&ITE_WATCH)) {
+		printf("\n\r--watch takes a single image file\n\r");
+		return 1;
+	}
+	if(g_patch_no && (g_flag&ITE_WATCH)) {
+		printf("\n\r--patch can't be combined with --watch\n\r");
+		return 1;
+	}
+
+	g_image_name=(manifest!=NULL)?manifest:filename;
+	if(manifest != NULL)
+		r=init_manifest(manifest);
+	else if(filename != NULL)
+		r=init_file(filename);
 	if(r) {
                 printf("Open file error\n\r");
                 exit(1);
 	}	
 
+	if((g_flag&ITE_DRY_RUN)) {
+		r=dry_run();
+		exit_file();
+		return r;
+	}
+
 	r=init_usb();
 	if (r < 0)
                 return r;
-
-
-	r=ite_device(VID,PID);
-	if(r<0) {
+	if((g_flag&ITE_LOW_JITTER) && lowjit_start())
+		g_flag&=~ITE_LOW_JITTER;
+
+
+	if((g_flag&ITE_STATION))
+		r=station_mode();
+	else
+		r=ite_device(VID,PID);
+	if((g_flag&ITE_STATION)) {
+		//per unit results already reported
+	} else if(r>0) {
+		printf("\n\rVerify Fail...\n\r");
+	} else if(r<0) {
 		printf("\n\rFlash Fail...");
 		printf("\n\rPlease re-plug the 8390 download board or ");
 		printf("\n\rpower on the ec...\n\r");
 	}
 
+	lowjit_stop();
         libusb_exit(NULL);
 
 	exit_file();
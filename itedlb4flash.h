@@ -23,13 +23,101 @@
 #define false (!true)
 #endif
 
+// per device session state, so several boards can be driven from threads
+#define ITE_TLS __thread
+
 #define ERR_EXIT(errcode) do { perr("   %s\n", libusb_strerror((enum libusb_error)errcode)); return -1; } while (0)
 #define CALL_CHECK(fcall) do { r=fcall; if (r < 0) ERR_EXIT(r); } while (0);
+#define PHASE_CALL(ph,fcall) do { double t_=now_ms(); r=fcall; g_phase_ms[ph]+=now_ms()-t_; if (r < 0) ERR_EXIT(r); } while (0);
 #define B(x) (((x)!=0)?1:0)
 #define be_to_int32(buf) (((buf)[0]<<24)|((buf)[1]<<16)|((buf)[2]<<8)|(buf)[3])
 
 #define RETRY_MAX                     5
 
+// command classes with their own latency statistics and timeouts
+#define ITE_CMD_CTRL			0 //DLB4 local: FW version, GPIO
+#define ITE_CMD_READ			1
+#define ITE_CMD_WRITE			2
+#define ITE_CMD_ERASE			3 //sector and block erase
+#define ITE_CMD_CHIP_ERASE		4
+#define ITE_CMD_EC			5 //EC side: debugger, registers, flash status and ID
+#define ITE_CMD_CLASSES			6
+
+#define ITE_TMO_CMD			1000  //CBW/CSW timeout until warmed up
+#define ITE_TMO_DATA			5000  //data timeout until warmed up
+#define ITE_TMO_SLACK			500   //added to any adaptive timeout
+#define ITE_TMO_WARMUP			8     //samples before timeouts adapt
+#define ITE_TMO_ERASE_PER_MB		10000 //chip erase allowance, unknown part
+#define ITE_TMO_ERASE_TYP		700   //sector/block erase, unknown part or chip
+#define ITE_HEALTH_DRIFT		2     //flag classes slower than 2x baseline
+
+typedef struct _CmdStats_
+{
+        uint32_t count;
+        uint32_t fails;
+        uint32_t timeouts;
+        double total_ms;
+        double mean_ms;          //moving average
+        double dev_ms;           //moving mean absolute deviation
+        double base_ms;          //average of the first ITE_TMO_WARMUP samples
+        double max_ms;
+
+}CmdStats;
+
+typedef struct _CmdTimeout_
+{
+        unsigned int cbw;
+        unsigned int data;
+        unsigned int csw;
+
+}CmdTimeout;
+
+ITE_TLS CmdStats g_cmd_stats[ITE_CMD_CLASSES];
+ITE_TLS CmdTimeout g_tmo;
+
+// host side stalls between commands, sleeps excluded
+typedef struct _JitterStats_
+{
+        int gaps;
+        double gap_sum;
+        double gap_max;
+        int over[3];            //gaps over 1, 10 and 100 ms
+        double lat_over_max;    //largest latency above its class mean
+        double last_ms;         //end of the previous command, 0 after a sleep
+
+}JitterStats;
+
+ITE_TLS JitterStats g_jit;
+
+// --low-jitter: libusb events on a dedicated SCHED_FIFO thread
+#define ITE_RT_PRIO			50
+
+int g_rt_cpu=-1;        //CPU of the event thread, -1 for the last one
+
+// run phases timed for the audit log
+#define ITE_PHASE_CONNECT		0
+#define ITE_PHASE_ERASE			1
+#define ITE_PHASE_CHECK			2
+#define ITE_PHASE_PROGRAM		3
+#define ITE_PHASE_VERIFY		4
+#define ITE_PHASE_REPAIR		5
+#define ITE_PHASE_RESET			6
+#define ITE_PHASES			7
+
+ITE_TLS double g_phase_ms[ITE_PHASES];
+ITE_TLS CmdStats g_audit_stats[ITE_CMD_CLASSES]; //g_cmd_stats at the start of the run
+ITE_TLS double g_audit_t0;
+ITE_TLS int g_connect_retries;
+char *g_audit_file;
+ITE_TLS char *g_image_name;
+
+// --dry-run state: commands per class, virtual sleep time and flash copy
+uint32_t g_dry_target;      //chip ID (I2C) or JEDEC ID (SPI) to simulate
+int g_dry_count[ITE_CMD_CLASSES];
+double g_dry_sleep_ms;
+unsigned char *g_dry_flash;
+int g_dry_flash_size;
+
 // _DLB4_CBW
 typedef struct _DLB4_CBW {
         //uint8_t dCBWSignature[4];
@@ -66,7 +154,121 @@ typedef struct _FlashInfo_
 
 }FlashInfo;
 
-FlashInfo Flash;
+ITE_TLS FlashInfo Flash;
+
+// SPI NOR part descriptor, keyed by the 3-byte JEDEC ID
+typedef struct _SpiFlashPart_
+{
+        uint8_t id[3];           //manufacturer, memory type, capacity
+        char name[24];
+        uint32_t size;           //capacity in bytes
+        uint32_t sector_size;    //smallest erase unit
+        uint32_t block_size;     //block erase unit
+        uint8_t read_mode;       //read command mode
+        uint8_t write_mode;      //write command mode
+        uint8_t write_type;      //write type
+        uint32_t block_erase_ms; //typical block erase time
+        uint32_t chip_erase_ms;  //typical chip erase time
+
+}SpiFlashPart;
+
+#define ITE_SPI_PARTS_MAX		64
+
+SpiFlashPart g_spi_parts_ovr[ITE_SPI_PARTS_MAX]; //entries from --parts file
+int g_spi_parts_ovr_no;
+ITE_TLS SpiFlashPart *g_spi_part;                          //part behind g_flash_id
+
+// EC chip descriptor, keyed by the chip ID read from 0x2085..0x2087
+typedef struct _EcChipInfo_
+{
+        uint32_t chip_id;        //e.g. 0x81302
+        char name[16];
+        uint32_t flash_size;     //internal flash size
+        uint32_t sector_size;    //smallest erase unit
+        uint32_t block_size;     //block erase unit
+        uint8_t erase_mode;      //sector or block erase
+        uint16_t erase_ms;       //typical sector erase
+
+}EcChipInfo;
+
+ITE_TLS EcChipInfo *g_chip;
+
+// Geometry the erase/check/program/verify stages are planned against
+typedef struct _FlashGeom_
+{
+        uint32_t size;
+        uint32_t sector_size;
+        uint32_t block_size;
+
+}FlashGeom;
+
+ITE_TLS FlashGeom g_geom;
+
+// per sector plan flags, one byte per sector of g_geom
+#define ITE_SECT_ERASE		0x01 //erased, blank-checked and verified
+#define ITE_SECT_BAD		0x02 //verify mismatch
+#define ITE_SECT_REPAIRED	0x04 //re-erased and re-programmed by --repair
+#define ITE_SECT_BLANK		0x08 //image data all 0xFF, nothing to program
+
+ITE_TLS uint8_t *g_sect_map;
+ITE_TLS int g_sect_no;
+ITE_TLS int g_blank_ready;      //ITE_SECT_BLANK is up to date for the plan
+
+// image file placed at a flash offset
+typedef struct _ImageRegion_
+{
+        char *filename;
+        uint32_t offset;
+        uint32_t size;
+
+}ImageRegion;
+
+#define ITE_REGIONS_MAX			16
+
+ITE_TLS ImageRegion g_region[ITE_REGIONS_MAX];
+ITE_TLS int g_region_no;
+
+// Image index sidecar (<image>.idx) written by 'ite index': per-sector
+// hashes in the hash manifest format plus a blank flag, image size and
+// hash, and the sector and flash size it was built for
+typedef struct _ImageIndex_
+{
+        unsigned char *buf;     //g_writebuf the index describes
+        int size;
+        int sector_size;
+        int flash_size;         //0 when built without a target
+        int sect_no;
+        uint64_t hash;          //ite_hash of the whole image
+        uint8_t *blank;
+
+}ImageIndex;
+
+#define ITE_INDEX_SECTOR		0x1000
+
+ITE_TLS ImageIndex g_index;
+
+// --patch: bytes written over the flash by sector read-modify-write
+typedef struct _FlashPatch_
+{
+        uint32_t offset;
+        uint32_t size;
+        unsigned char *data;
+
+}FlashPatch;
+
+#define ITE_PATCH_MAX			16
+
+FlashPatch g_patch[ITE_PATCH_MAX];
+int g_patch_no;
+
+char *g_ext_image;      //--external, image for the SPI flash behind the EC
+ITE_TLS int g_external; //the external flash is selected (StartD2ec(11))
+
+char *g_hash_ref;       //--hash-ref, per-sector hashes to verify against
+char *g_hash_out;       //--hash-out, per-sector hashes found by --verify-only
+
+ITE_TLS uint32_t g_win_offset;  //--offset, flash window start
+ITE_TLS uint32_t g_win_length;  //--length, 0 means up to the end of the image
 
 typedef struct _DLB4_INFO_
 {
@@ -75,7 +277,7 @@ typedef struct _DLB4_INFO_
         libusb_device_handle *handle;
 }DLB4_INFO;
 
-DLB4_INFO devinfo;
+ITE_TLS DLB4_INFO devinfo;
 
 
 typedef struct _DLB4_OP_
@@ -96,7 +298,23 @@ typedef struct _DLB4_OP_
 
 }DLB4_OP;
 
-DLB4_OP cmdParam;
+ITE_TLS DLB4_OP cmdParam;
+
+#define ITE_REG_WINDOW			16 //register commands in flight
+
+// --peek/--poke, run in command line order
+typedef struct _RegAccess_
+{
+        uint16_t addr;
+        int len;
+        uint8_t *data;          //bytes to write, NULL for a read
+
+}RegAccess;
+
+#define ITE_REG_ACCESS_MAX		16
+
+RegAccess g_reg[ITE_REG_ACCESS_MAX];
+int g_reg_no;
 
 #define ITE_FW_CTL               	0xF0
 #define ITE_FW_CTL_READ_FW_VER          0x02
@@ -141,6 +359,7 @@ DLB4_OP cmdParam;
 
 #define ITE_ERASE_TYPE_3_UNPROTECT_E	0x03
 
+#define ITE_READ_MODE			0x03
 #define ITE_PROGRAM_MODE		0x03
 #define ITE_PROGRAM_TYPE		0x00
 
@@ -159,32 +378,167 @@ DLB4_OP cmdParam;
 #define ITE_SKIP_CHECK  0x01
 #define ITE_SKIP_VERIFY 0x02
 #define ITE_USE_SPI 	0x04
+#define ITE_REPAIR 	0x08
+#define ITE_STATION 	0x10
+#define ITE_WATCH 	0x20
+#define ITE_DRY_RUN 	0x40
+#define ITE_IDENTIFY 	0x80
+#define ITE_VERIFY_ONLY 0x100
+#define ITE_LOW_JITTER 	0x200
 
 #define ITE_CONNECT_MODE_NODBGR	0x02
 #define ITE_CONNECT_MODE_DBGR   0x03
 
 
 static uint16_t VID, PID;
-FILE *fi;
-unsigned char *g_readbuf;
-unsigned char *g_writebuf;
-int g_flash_size;
-int g_blk_size;
-int g_blk_no;
-int g_flag=0;
-
-unsigned char g_fw_ver[4];
-unsigned char g_chip_id[6];
-unsigned char g_flash_id[6];
-
-unsigned char ITE_CONNECT_MODE;
-
-unsigned char ITE_OP_CODE;
-unsigned char ITE_FUN_CODE_FLASHID;
-unsigned char ITE_FUN_CODE_READ;
-unsigned char ITE_FUN_CODE_ERASE;
-unsigned char ITE_FUN_CODE_WRITE;
+ITE_TLS FILE *fi;
+ITE_TLS unsigned char *g_readbuf;
+ITE_TLS unsigned char *g_writebuf;
+ITE_TLS int g_flash_size;
+ITE_TLS int g_file_size;
+ITE_TLS int g_blk_size;
+ITE_TLS int g_blk_no;
+ITE_TLS int g_flag=0;
+
+ITE_TLS unsigned char g_fw_ver[4];
+ITE_TLS unsigned char g_chip_id[6];
+ITE_TLS unsigned char g_flash_id[6];
+
+ITE_TLS unsigned char ITE_CONNECT_MODE;
+
+ITE_TLS unsigned char ITE_OP_CODE;
+ITE_TLS unsigned char ITE_FUN_CODE_FLASHID;
+ITE_TLS unsigned char ITE_FUN_CODE_READ;
+ITE_TLS unsigned char ITE_FUN_CODE_ERASE;
+ITE_TLS unsigned char ITE_FUN_CODE_WRITE;
+
+// boards reported by the hotplug callback, in arrival order
+#define ITE_HOTPLUG_MAX			32
+
+libusb_device *g_hotplug_dev[ITE_HOTPLUG_MAX];
+int g_hotplug_head;
+int g_hotplug_no;
+volatile int g_stop;
+
+// Minimum waits in ms, set with --wait. Where the tool can observe the EC
+// becoming ready it polls after the minimum instead of sleeping a fixed time.
+typedef struct _WaitCfg_
+{
+        unsigned int special;   //special waveform before entering debug mode
+        unsigned int spi;       //each GPIO step of enter_spi()
+        unsigned int reset;     //EC reset pulse in reset_ec()
+
+}WaitCfg;
+
+#define ITE_WAIT_SPECIAL		10
+#define ITE_WAIT_SPECIAL_MAX		50   //former fixed wait
+#define ITE_WAIT_SPI			10
+#define ITE_WAIT_SPI_MAX		100  //former fixed wait per step
+#define ITE_WAIT_RESET			20   //EC reset pulse on C1, former sleep(1)
+#define ITE_WAIT_POLL			5    //poll interval
+#define ITE_WAIT_READY_MAX		1000 //give up polling after
+
+WaitCfg g_wait={ITE_WAIT_SPECIAL,ITE_WAIT_SPI,ITE_WAIT_RESET};
+ITE_TLS unsigned int g_special_ms;  //special waveform wait of the next connect
+
+// Image, plan and geometry of one flash target, set aside while the other
+// target is programmed in the same session
+typedef struct _TargetState_
+{
+        unsigned char *writebuf;
+        unsigned char *readbuf;
+        uint8_t *sect_map;
+        int sect_no;
+        ImageRegion region[ITE_REGIONS_MAX];
+        int region_no;
+        int file_size;
+        int flash_size;
+        int blk_no;
+        uint32_t win_offset;
+        uint32_t win_length;
+        FlashGeom geom;
+        FlashInfo flash;
+        SpiFlashPart *spi_part;
+        unsigned char flash_id[6];
+        ImageIndex index;
+
+}TargetState;
+
+// --jobs: one image per line, run on the first compatible idle board
+#define ITE_JOB_PENDING			0
+#define ITE_JOB_RUNNING			1
+#define ITE_JOB_DONE			2
+#define ITE_JOB_NO_BOARD		3
+
+typedef struct _FlashJob_
+{
+        char *image;
+        int spi;                //flash through SPI (-u) instead of I2C
+        uint32_t id;            //chip ID (I2C) or JEDEC ID (SPI), 0 for any board
+        long size;              //image bytes, the queue load estimate
+        int state;
+        int owner;              //board the job was queued on
+        int board;              //board that ran it
+        int level;              //jobs running on its hub when it started
+        int result;
+        double ms;
+
+}FlashJob;
+
+// one worker thread per attached DLB4 board
+typedef struct _BoardWorker_
+{
+        libusb_device *dev;
+        libusb_device_handle *handle;
+        char port[32];
+        int idx;
+        uint32_t id[2];         //chip ID over I2C, JEDEC ID over SPI, 0 if unknown
+        int speed;              //enum libusb_speed of the board's link
+        int hub;                //index in g_hub of its upstream link
+        long queued;            //bytes of pending jobs queued on this board
+        int jobs;
+        int stolen;             //jobs taken from another board's queue
+        int fails;
+        double busy_ms;
+
+}BoardWorker;
+
+// Boards behind one hub share its upstream link. Jobs on a hub start one
+// at a time and another is only let in while it adds throughput.
+#define ITE_HUB_LEVELS			16
+#define ITE_HUB_GAIN			1.1 //next level must add 10% MB/s
+
+typedef struct _HubLink_
+{
+        char path[32];          //bus-port chain of the hub, bus number for the root hub
+        int boards;
+        int active;             //jobs running behind the hub
+        int limit;              //jobs allowed at once
+        int settled;            //limit backed off, no more growth
+        double rate[ITE_HUB_LEVELS]; //MB/s of one job with 1..N running, 0 until measured
+        long bytes;
+        int jobs;
+        double busy_ms;         //wall time with at least one job running
+        double busy_t0;
+
+}HubLink;
+
+FlashJob *g_job;
+int g_job_no;
+HubLink *g_hub;
+int g_hub_no;
+BoardWorker *g_board;
+int g_board_no;
+int g_job_flag;         //g_flag of the command line, workers start from it
+int g_job_probe;        //interfaces (1<<spi) the jobs match board IDs on
 
 void show_time();
-int enter_spi();
+void set_interface();
+int enter_spi(unsigned int step_ms);
+void check_parameter();
+int init_file(char* filename);
+void exit_file();
+void free_index();
+int connect_dbgr_retry(int tries);
+int reg_access();
 